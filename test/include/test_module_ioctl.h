@@ -30,10 +30,23 @@
 extern "C" {
 #endif
 
+#define TEST_MAX_NUMA_NODES 16
+#define TEST_MAX_ZONES 8
+#define TEST_ZONE_NAME_LEN 12
+
 typedef struct {
 	int shared_fd;
 	int mem_size;
 	bool verify_result;			/* 0 means fail, 1 means success. */
+	int nents;					/* out: number of scatterlist segments. */
+	__u64 attach_ns;			/* out: dma_buf_attach() time. */
+	__u64 map_ns;				/* out: dma_buf_map_attachment() time. */
+	__u64 unmap_ns;				/* out: dma_buf_unmap_attachment() time. */
+	__u64 detach_ns;			/* out: dma_buf_detach() time. */
+	__u64 node_bytes[TEST_MAX_NUMA_NODES];	/* out: bytes backed by each NUMA node. */
+	__u64 other_node_bytes;		/* out: bytes backed by nodes >= TEST_MAX_NUMA_NODES. */
+	__u64 zone_bytes[TEST_MAX_ZONES];		/* out: bytes backed by each zone index. */
+	char zone_name[TEST_MAX_ZONES][TEST_ZONE_NAME_LEN];	/* out: name of each zone seen. */
 } test_verify_args;
 
 typedef struct {
@@ -44,12 +57,53 @@ typedef struct {
 	int simulate_page_unit_size;
 } test_simulate_args;
 
+/*
+ * Fault injection applied to the page allocations done by the test module,
+ * with the same meaning as the kernel's fail_page_alloc attributes: every
+ * fail_interval-th allocation of at least min_order fails with
+ * fail_probability percent.
+ */
+typedef struct {
+	int fail_interval;			/* 0 or 1 considers every allocation. */
+	int fail_probability;		/* chance to fail in percent, 0 disables. */
+	int delay_us;				/* delay added before each allocation. */
+	int min_order;
+	int injected_failures;		/* out: failures injected with previous settings. */
+} test_fault_inject_args;
+
+/* gfp_mode bits of test_alloc_bench_args. */
+#define TEST_ALLOC_BENCH_RECLAIM	(1 << 0)	/* allow direct reclaim. */
+#define TEST_ALLOC_BENCH_COMPACT	(1 << 1)	/* allow direct compaction, needs RECLAIM. */
+#define TEST_ALLOC_BENCH_NORETRY	(1 << 2)	/* __GFP_NORETRY. */
+#define TEST_ALLOC_BENCH_HOLD		(1 << 3)	/* hold pages until the run ends. */
+
+#define TEST_ALLOC_BENCH_MAX_TIMES 65536
+#define TEST_ALLOC_BENCH_BUCKETS 64
+
+/*
+ * Time alloc_times calls of alloc_pages() at the given order. Bucket i of
+ * latency_hist counts the calls that took [2^(i-1), 2^i) ns, failed calls
+ * included.
+ */
+typedef struct {
+	int order;
+	int gfp_mode;
+	int alloc_times;
+	int success_times;			/* out */
+	__u64 min_ns;				/* out */
+	__u64 max_ns;				/* out */
+	__u64 total_ns;				/* out */
+	__u64 latency_hist[TEST_ALLOC_BENCH_BUCKETS];	/* out */
+} test_alloc_bench_args;
+
 #define IOC_BASE           0x82
 
 #define TEST_IOCTL_VERIFY_CPA _IOWR(IOC_BASE, 1, test_verify_args)
 #define TEST_IOCTL_START_SIMULATE_FRAGMENT _IOWR(IOC_BASE, 2, test_simulate_args)
 #define TEST_IOCTL_FREE_ONE_PAGE_UNIT _IOWR(IOC_BASE, 3, test_simulate_args)
 #define TEST_IOCTL_STOP_SIMULATE_FRAGMENT _IOWR(IOC_BASE, 4, test_simulate_args)
+#define TEST_IOCTL_SET_FAULT_INJECT _IOWR(IOC_BASE, 5, test_fault_inject_args)
+#define TEST_IOCTL_ALLOC_PAGES_BENCH _IOWR(IOC_BASE, 6, test_alloc_bench_args)
 
 #ifdef __cplusplus
 }
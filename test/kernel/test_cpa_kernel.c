@@ -35,11 +35,28 @@
 #include <linux/delay.h>
 #include <linux/freezer.h>
 #include <linux/uaccess.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/random.h>
+#include <linux/ktime.h>
+#include <linux/bitops.h>
+#include <linux/sched.h>
 
 #include "test_module_ioctl.h"
 
-LIST_HEAD(allocated_pages);
-static int page_counter;
+/*
+ * Per-open state of the fragmentation simulator. Each open() of
+ * /dev/test_cpa gets its own page list, so several test processes can run
+ * side by side. The lock serialises threads sharing one file descriptor.
+ */
+struct test_cpa_ctx {
+	struct mutex lock;
+	struct list_head allocated_pages;
+	int page_counter;
+	test_fault_inject_args fault;
+	unsigned long fault_calls;
+};
 
 struct platform_device test_device = {
 	.name		= "test_cpa",
@@ -84,7 +101,12 @@ struct miscdevice test_miscdevice = {
 	.fops = &test_fops,
 };
 
-/* Verify buffer allocated from CPA is 2MB compound page. */
+/*
+ * Verify buffer allocated from CPA is 2MB compound page. Attach, map,
+ * unmap and detach are timed separately and returned with the number of
+ * scatterlist segments, as importers pay them for every mapping. The
+ * NUMA node and zone backing each segment are accounted as well.
+ */
 int test_verify_allocated_buffer(test_verify_args __user *user_arg)
 {
 	test_verify_args arg;
@@ -92,8 +114,13 @@ int test_verify_allocated_buffer(test_verify_args __user *user_arg)
 	struct dma_buf_attachment *attachment;
 	struct sg_table *sgt;
 	struct scatterlist *sg;
-	int fd, mem_size, i;
+	int fd, mem_size, i, nents;
 	bool result = true;
+	u64 start_ns, attach_ns, map_ns, unmap_ns, detach_ns;
+	u64 node_bytes[TEST_MAX_NUMA_NODES] = { 0 };
+	u64 other_node_bytes = 0;
+	u64 zone_bytes[TEST_MAX_ZONES] = { 0 };
+	char zone_name[TEST_MAX_ZONES][TEST_ZONE_NAME_LEN] = { { 0 } };
 
 	if (0 != copy_from_user(&arg, (void __user *)user_arg,
 				sizeof(test_verify_args)))
@@ -108,13 +135,17 @@ int test_verify_allocated_buffer(test_verify_args __user *user_arg)
 		return PTR_RET(buf);
 	}
 
+	start_ns = ktime_get_ns();
 	attachment = dma_buf_attach(buf, &test_device.dev);
-	if (NULL == attachment) {
+	attach_ns = ktime_get_ns() - start_ns;
+	if (IS_ERR_OR_NULL(attachment)) {
 		dma_buf_put(buf);
 		return -EFAULT;
 	}
 
+	start_ns = ktime_get_ns();
 	sgt = dma_buf_map_attachment(attachment, DMA_BIDIRECTIONAL);
+	map_ns = ktime_get_ns() - start_ns;
 	if (IS_ERR_OR_NULL(sgt)) {
 		pr_err("Failed to map dma-buf attachment\n");
 		dma_buf_detach(buf, attachment);
@@ -123,6 +154,33 @@ int test_verify_allocated_buffer(test_verify_args __user *user_arg)
 		return -EFAULT;
 	}
 
+	/*
+	 * Walk the CPU segments, an IOMMU may have merged several of them
+	 * into one DMA segment. Each is physically contiguous, so its first
+	 * page tells the node and zone.
+	 */
+	for_each_sg(sgt->sgl, sg, sgt->orig_nents, i) {
+		struct page *page = sg_page(sg);
+		int nid, zid;
+
+		if (!page)
+			continue;
+
+		nid = page_to_nid(page);
+		zid = page_zonenum(page);
+
+		if (nid < TEST_MAX_NUMA_NODES)
+			node_bytes[nid] += sg->length;
+		else
+			other_node_bytes += sg->length;
+
+		if (zid < TEST_MAX_ZONES) {
+			zone_bytes[zid] += sg->length;
+			strlcpy(zone_name[zid], page_zone(page)->name,
+				TEST_ZONE_NAME_LEN);
+		}
+	}
+
 	for_each_sg(sgt->sgl, sg, sgt->nents, i) {
 		u32 size = sg_dma_len(sg);
 
@@ -138,12 +196,51 @@ int test_verify_allocated_buffer(test_verify_args __user *user_arg)
 	if (mem_size > 0)
 		result = 0;
 
+	nents = sgt->nents;
+
+	start_ns = ktime_get_ns();
+	dma_buf_unmap_attachment(attachment, sgt, DMA_BIDIRECTIONAL);
+	unmap_ns = ktime_get_ns() - start_ns;
+
+	start_ns = ktime_get_ns();
 	dma_buf_detach(buf, attachment);
+	detach_ns = ktime_get_ns() - start_ns;
+
 	dma_buf_put(buf);
 
 	if (0 != put_user(result, &user_arg->verify_result))
 		return -EFAULT;
 
+	if (0 != put_user(nents, &user_arg->nents))
+		return -EFAULT;
+
+	if (0 != put_user(attach_ns, &user_arg->attach_ns))
+		return -EFAULT;
+
+	if (0 != put_user(map_ns, &user_arg->map_ns))
+		return -EFAULT;
+
+	if (0 != put_user(unmap_ns, &user_arg->unmap_ns))
+		return -EFAULT;
+
+	if (0 != put_user(detach_ns, &user_arg->detach_ns))
+		return -EFAULT;
+
+	if (0 != copy_to_user(user_arg->node_bytes, node_bytes,
+				sizeof(node_bytes)))
+		return -EFAULT;
+
+	if (0 != put_user(other_node_bytes, &user_arg->other_node_bytes))
+		return -EFAULT;
+
+	if (0 != copy_to_user(user_arg->zone_bytes, zone_bytes,
+				sizeof(zone_bytes)))
+		return -EFAULT;
+
+	if (0 != copy_to_user(user_arg->zone_name, zone_name,
+				sizeof(zone_name)))
+		return -EFAULT;
+
 	return 0;
 }
 
@@ -156,29 +253,84 @@ int test_verify_allocated_buffer(test_verify_args __user *user_arg)
  */
 #define MEM_FRAGMENT_GAP 11
 
+/*
+ * alloc_pages() with the fault injection configured for ctx applied,
+ * caller must hold ctx->lock. Like the kernel's fail_page_alloc, every
+ * fail_interval-th allocation fails with fail_probability percent.
+ */
+static struct page *test_alloc_pages(struct test_cpa_ctx *ctx, gfp_t gfp_flags,
+				unsigned int order)
+{
+	test_fault_inject_args *fault = &ctx->fault;
+
+	if (order < fault->min_order)
+		return alloc_pages(gfp_flags, order);
+
+	if (0 < fault->delay_us)
+		usleep_range(fault->delay_us, fault->delay_us + 1);
+
+	if (0 == fault->fail_probability)
+		return alloc_pages(gfp_flags, order);
+
+	ctx->fault_calls++;
+
+	if (1 < fault->fail_interval &&
+		0 != ctx->fault_calls % fault->fail_interval)
+		return alloc_pages(gfp_flags, order);
+
+	if (prandom_u32() % 100 >= fault->fail_probability)
+		return alloc_pages(gfp_flags, order);
+
+	fault->injected_failures++;
+
+	return NULL;
+}
+
+/* free every page unit hold by ctx, caller must hold ctx->lock. */
+static void test_free_simulate_pages(struct test_cpa_ctx *ctx)
+{
+	struct page *page, *tmp_page;
+
+	list_for_each_entry_safe(page, tmp_page, &ctx->allocated_pages, lru) {
+		list_del_init(&page->lru);
+		__free_pages(page, ALLOC_PAGE_ORDER);
+	}
+
+	ctx->page_counter = 0;
+}
+
 /*
  * Try to simulate system memory fragment problem
  * through allocating and free behaviors.
  */
-int test_start_simulate_memory_fragment(test_simulate_args __user *user_arg)
+int test_start_simulate_memory_fragment(struct test_cpa_ctx *ctx,
+				test_simulate_args __user *user_arg)
 {
 	struct page *page, *tmp_page, *new_page;
 	unsigned int fail_times = 0;
 	unsigned int page_num = 0;
 	int inserted = 0;
+	int ret = 0;
 
 	/* these flags will not trigger OOM killer. */
 	gfp_t gfp_flags = GFP_HIGHUSER | __GFP_ZERO |
 			__GFP_NOWARN | __GFP_REPEAT;
 
+	if (mutex_lock_interruptible(&ctx->lock))
+		return -ERESTARTSYS;
+
 	while (1) {
-		new_page = alloc_pages(gfp_flags, ALLOC_PAGE_ORDER);
+		/* other users of the file wait for the lock, stay killable. */
+		if (fatal_signal_pending(current))
+			break;
+
+		new_page = test_alloc_pages(ctx, gfp_flags, ALLOC_PAGE_ORDER);
 
 		if (new_page) {
 			inserted = 0;
 			/* insert new page in descending order. */
 			list_for_each_entry_safe(page, tmp_page,
-						&allocated_pages, lru) {
+						&ctx->allocated_pages, lru) {
 				if (new_page > page) {
 					list_add(&new_page->lru, &page->lru);
 					inserted = 1;
@@ -187,9 +339,10 @@ int test_start_simulate_memory_fragment(test_simulate_args __user *user_arg)
 			}
 
 			if (!inserted)
-				list_add(&new_page->lru, &allocated_pages);
+				list_add(&new_page->lru,
+					&ctx->allocated_pages);
 
-			page_counter++;
+			ctx->page_counter++;
 		} else {
 			fail_times++;
 			if (fail_times >= TEST_ALLOC_FAIL_TIMES)
@@ -198,23 +351,23 @@ int test_start_simulate_memory_fragment(test_simulate_args __user *user_arg)
 	}
 
 	page_num = 0;
-	list_for_each_entry_safe(page, tmp_page, &allocated_pages, lru) {
+	list_for_each_entry_safe(page, tmp_page, &ctx->allocated_pages, lru) {
 		page_num++;
 		if (page_num % MEM_FRAGMENT_GAP == 0)
 			continue;
 
 		list_del_init(&page->lru);
 		__free_pages(page, ALLOC_PAGE_ORDER);
-		page_counter--;
+		ctx->page_counter--;
 	}
 
 	if (0 != put_user(true, &user_arg->simulate_result))
 		goto error_process;
 
-	if (0 != put_user(page_counter, &user_arg->alloc_times))
+	if (0 != put_user(ctx->page_counter, &user_arg->alloc_times))
 		goto error_process;
 
-	if (0 != put_user(page_counter*ALLOC_PAGE_SIZE,
+	if (0 != put_user(ctx->page_counter*ALLOC_PAGE_SIZE,
 				&user_arg->test_allocated_page))
 		goto error_process;
 
@@ -226,30 +379,40 @@ int test_start_simulate_memory_fragment(test_simulate_args __user *user_arg)
 				&user_arg->system_free_pages))
 		goto error_process;
 
-	return 0;
+	goto out;
 
 error_process:
-	list_for_each_entry_safe(page, tmp_page, &allocated_pages, lru) {
-		list_del_init(&page->lru);
-		__free_pages(page, ALLOC_PAGE_ORDER);
-		page_counter--;
-	}
+	test_free_simulate_pages(ctx);
+	ret = -EFAULT;
 
-	return -EFAULT;
+out:
+	mutex_unlock(&ctx->lock);
+
+	return ret;
 }
 
 /* free one page unit  hold in hand. */
-int test_free_one_simulate_page_unit(test_simulate_args __user *user_arg)
+int test_free_one_simulate_page_unit(struct test_cpa_ctx *ctx,
+				test_simulate_args __user *user_arg)
 {
 	struct page *page;
+	int page_counter;
+
+	if (mutex_lock_interruptible(&ctx->lock))
+		return -ERESTARTSYS;
 
-	if (0 < page_counter) {
-		page = list_first_entry(&allocated_pages, struct page, lru);
+	if (0 < ctx->page_counter) {
+		page = list_first_entry(&ctx->allocated_pages,
+					struct page, lru);
 		list_del_init(&page->lru);
 		__free_pages(page, ALLOC_PAGE_ORDER);
-		page_counter--;
+		ctx->page_counter--;
 	}
 
+	page_counter = ctx->page_counter;
+
+	mutex_unlock(&ctx->lock);
+
 	if (0 != put_user(true, &user_arg->simulate_result))
 		return -EFAULT;
 
@@ -265,18 +428,166 @@ int test_free_one_simulate_page_unit(test_simulate_args __user *user_arg)
 }
 
 /* free all mem hold in hand.*/
-int test_stop_simulate_memory_fragment(test_simulate_args __user *user_arg)
+int test_stop_simulate_memory_fragment(struct test_cpa_ctx *ctx,
+				test_simulate_args __user *user_arg)
 {
+	if (mutex_lock_interruptible(&ctx->lock))
+		return -ERESTARTSYS;
+	test_free_simulate_pages(ctx);
+	mutex_unlock(&ctx->lock);
+
+	if (0 != put_user(true, &user_arg->simulate_result))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * Replace the fault injection settings. The number of failures injected
+ * with the previous settings is returned to user space.
+ */
+int test_set_fault_inject(struct test_cpa_ctx *ctx,
+				test_fault_inject_args __user *user_arg)
+{
+	test_fault_inject_args arg;
+	int injected_failures;
+
+	if (0 != copy_from_user(&arg, (void __user *)user_arg,
+				sizeof(test_fault_inject_args)))
+		return -EFAULT;
+
+	if (arg.fail_interval < 0 || arg.fail_probability < 0 ||
+		arg.fail_probability > 100 || arg.delay_us < 0 ||
+		arg.min_order < 0 || arg.min_order >= MAX_ORDER)
+		return -EINVAL;
+
+	arg.injected_failures = 0;
+
+	if (mutex_lock_interruptible(&ctx->lock))
+		return -ERESTARTSYS;
+	injected_failures = ctx->fault.injected_failures;
+	ctx->fault = arg;
+	ctx->fault_calls = 0;
+	mutex_unlock(&ctx->lock);
+
+	if (0 != put_user(injected_failures, &user_arg->injected_failures))
+		return -EFAULT;
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0)
+#define TEST_GFP_RECLAIM __GFP_DIRECT_RECLAIM
+#else
+#define TEST_GFP_RECLAIM __GFP_WAIT
+#endif
+
+/*
+ * Build the gfp mask for the allocation benchmark. Pages are zeroed and
+ * compound like the ones CPA hands out, reclaim and compaction are only
+ * allowed when requested.
+ */
+static gfp_t test_alloc_bench_gfp(int gfp_mode, int order)
+{
+	gfp_t gfp_flags = __GFP_HIGHMEM | __GFP_HARDWALL | __GFP_ZERO |
+			__GFP_COMP | __GFP_NOWARN;
+
+	if (gfp_mode & TEST_ALLOC_BENCH_RECLAIM)
+		gfp_flags |= TEST_GFP_RECLAIM;
+
+	if (gfp_mode & TEST_ALLOC_BENCH_COMPACT)
+		gfp_flags |= __GFP_IO | __GFP_FS;
+
+	if (gfp_mode & TEST_ALLOC_BENCH_NORETRY)
+		gfp_flags |= __GFP_NORETRY;
+
+	/*
+	 * Held non-costly orders would be retried until the OOM killer
+	 * frees memory for them, give up on them instead.
+	 */
+	if ((gfp_mode & TEST_ALLOC_BENCH_HOLD) &&
+		(gfp_mode & TEST_ALLOC_BENCH_RECLAIM) &&
+		order <= PAGE_ALLOC_COSTLY_ORDER)
+		gfp_flags |= __GFP_NORETRY;
+
+	return gfp_flags;
+}
+
+/*
+ * Time each alloc_pages() call of a run at the requested order and gfp
+ * mode. Pages are freed straight away, or held until the run ends so the
+ * run behaves like CPA filling its pool.
+ */
+int test_alloc_pages_benchmark(struct test_cpa_ctx *ctx,
+				test_alloc_bench_args __user *user_arg)
+{
+	test_alloc_bench_args arg;
 	struct page *page, *tmp_page;
+	LIST_HEAD(held_pages);
+	gfp_t gfp_flags;
+	u64 start_ns, latency_ns;
+	int i, bucket, ret = 0;
+
+	if (0 != copy_from_user(&arg, (void __user *)user_arg,
+				sizeof(test_alloc_bench_args)))
+		return -EFAULT;
+
+	if (arg.order < 0 || arg.order >= MAX_ORDER ||
+		arg.alloc_times <= 0 ||
+		arg.alloc_times > TEST_ALLOC_BENCH_MAX_TIMES)
+		return -EINVAL;
+
+	gfp_flags = test_alloc_bench_gfp(arg.gfp_mode, arg.order);
+
+	arg.success_times = 0;
+	arg.min_ns = U64_MAX;
+	arg.max_ns = 0;
+	arg.total_ns = 0;
+	memset(arg.latency_hist, 0, sizeof(arg.latency_hist));
+
+	if (mutex_lock_interruptible(&ctx->lock))
+		return -ERESTARTSYS;
+
+	for (i = 0; i < arg.alloc_times; i++) {
+		/* a long reclaim run must still be killable. */
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+
+		start_ns = ktime_get_ns();
+		page = test_alloc_pages(ctx, gfp_flags, arg.order);
+		latency_ns = ktime_get_ns() - start_ns;
+
+		bucket = min(fls64(latency_ns), TEST_ALLOC_BENCH_BUCKETS - 1);
+		arg.latency_hist[bucket]++;
+		arg.total_ns += latency_ns;
+		arg.min_ns = min(arg.min_ns, latency_ns);
+		arg.max_ns = max(arg.max_ns, latency_ns);
+
+		if (page) {
+			arg.success_times++;
+			if (arg.gfp_mode & TEST_ALLOC_BENCH_HOLD)
+				list_add(&page->lru, &held_pages);
+			else
+				__free_pages(page, arg.order);
+		}
+
+		cond_resched();
+	}
 
-	list_for_each_entry_safe(page, tmp_page, &allocated_pages, lru) {
+	list_for_each_entry_safe(page, tmp_page, &held_pages, lru) {
 		list_del_init(&page->lru);
-		__free_pages(page, ALLOC_PAGE_ORDER);
+		__free_pages(page, arg.order);
 	}
 
-	page_counter = 0;
+	mutex_unlock(&ctx->lock);
 
-	if (0 != put_user(true, &user_arg->simulate_result))
+	if (0 != ret)
+		return ret;
+
+	if (0 != copy_to_user((void __user *)user_arg, &arg,
+				sizeof(test_alloc_bench_args)))
 		return -EFAULT;
 
 	return 0;
@@ -284,22 +595,44 @@ int test_stop_simulate_memory_fragment(test_simulate_args __user *user_arg)
 
 static int test_open(struct inode *inode, struct file *filp)
 {
+	struct test_cpa_ctx *ctx;
+
 	/* input validation */
 	if (test_miscdevice.minor != iminor(inode)) {
 		pr_err("open() Minor does not match\n");
 		return -ENODEV;
 	}
 
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (NULL == ctx)
+		return -ENOMEM;
+
+	mutex_init(&ctx->lock);
+	INIT_LIST_HEAD(&ctx->allocated_pages);
+	filp->private_data = ctx;
+
 	return 0;
 }
 
 static int test_release(struct inode *inode, struct file *filp)
 {
-	/* input validation */
-	if (test_miscdevice.minor != iminor(inode)) {
+	struct test_cpa_ctx *ctx = filp->private_data;
+
+	/*
+	 * release() can not fail, so only warn on a minor mismatch and always
+	 * free the context open() created.
+	 */
+	if (test_miscdevice.minor != iminor(inode))
 		pr_err("release() Minor does not match\n");
-		return -ENODEV;
-	}
+
+	/* return pages a crashed or careless process left behind. */
+	mutex_lock(&ctx->lock);
+	test_free_simulate_pages(ctx);
+	mutex_unlock(&ctx->lock);
+
+	mutex_destroy(&ctx->lock);
+	kfree(ctx);
+	filp->private_data = NULL;
 
 	return 0;
 }
@@ -311,6 +644,7 @@ static int test_ioctl(struct inode *inode, struct file *filp, unsigned int cmd,
 			unsigned long arg)
 #endif
 {
+	struct test_cpa_ctx *ctx = filp->private_data;
 	int err;
 
 #ifndef HAVE_UNLOCKED_IOCTL
@@ -329,17 +663,25 @@ static int test_ioctl(struct inode *inode, struct file *filp, unsigned int cmd,
 				(test_verify_args __user *)arg);
 		break;
 	case TEST_IOCTL_START_SIMULATE_FRAGMENT:
-		err = test_start_simulate_memory_fragment(
+		err = test_start_simulate_memory_fragment(ctx,
 				(test_simulate_args __user *)arg);
 		break;
 	case TEST_IOCTL_FREE_ONE_PAGE_UNIT:
-		err = test_free_one_simulate_page_unit(
+		err = test_free_one_simulate_page_unit(ctx,
 				(test_simulate_args __user *)arg);
 		break;
 	case TEST_IOCTL_STOP_SIMULATE_FRAGMENT:
-		err = test_stop_simulate_memory_fragment(
+		err = test_stop_simulate_memory_fragment(ctx,
 				(test_simulate_args __user *)arg);
 		break;
+	case TEST_IOCTL_SET_FAULT_INJECT:
+		err = test_set_fault_inject(ctx,
+				(test_fault_inject_args __user *)arg);
+		break;
+	case TEST_IOCTL_ALLOC_PAGES_BENCH:
+		err = test_alloc_pages_benchmark(ctx,
+				(test_alloc_bench_args __user *)arg);
+		break;
 	default:
 		pr_err("No handler for ioctl 0x%08X 0x%08lX\n",
 			cmd, arg);
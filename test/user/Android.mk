@@ -3,7 +3,8 @@ include $(CLEAR_VARS)
 
 LOCAL_C_INCLUDES += $(LOCAL_PATH)/../include/
 LOCAL_SRC_FILES:= \
-	ion_compound_page_test.cpp
+	ion_compound_page_test.cpp \
+	test_histogram.cpp
 
 LOCAL_SHARED_LIBRARIES := \
     libcutils \
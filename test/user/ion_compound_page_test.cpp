@@ -24,210 +24,2201 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <time.h>
 #include <cutils/log.h>
 #include <linux/ion.h>
 #include <ion/ion.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 
 #include "test_module_ioctl.h"
+#include "test_histogram.h"
 
 #define TEST_DEV_PATH "/dev/test_cpa"
+#define TEST_IGNORE(x) (void)x
 #define AERR(fmt, args...) __android_log_print(ANDROID_LOG_ERROR, "[Test-CPA-ERROR]", "%s:%d " fmt,__func__,__LINE__,##args)
 
-static int ion_client = 0;
-static int test_handle = 0;
+static int ion_client = 0;
+static int test_handle = 0;
+
+/* verify buffers with a worker pool after allocating, instead of one by one. */
+static bool parallel_verify = false;
+
+/* print every histogram bucket, not only the percentiles. */
+static bool dump_histograms = false;
+
+uint64_t test_get_time_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* latency of the verify ioctl and the dma-buf steps it times, in ns. */
+typedef struct {
+	test_histogram verify;
+	test_histogram attach;
+	test_histogram map;
+	test_histogram unmap;
+	test_histogram detach;
+} test_verify_stats;
+
+/* latency of every timed operation, in ns. */
+typedef struct {
+	test_histogram alloc;
+	test_histogram share;
+	test_verify_stats dma;
+	test_histogram free;
+	test_histogram mmap;
+	test_histogram munmap;
+	test_histogram fragment;
+} test_latency_stats;
+
+static test_latency_stats latency_stats;
+
+/*
+ * System heap buffers, only used as a baseline by the mmap and dma-buf
+ * benchmarks, record here so latency_stats only holds CPA samples.
+ */
+static test_latency_stats system_latency_stats;
+
+/*
+ * Threads other than the main thread record into their own instance, which
+ * the main thread merges into latency_stats after joining them.
+ */
+static __thread test_latency_stats *thread_latency_stats = NULL;
+
+void test_verify_stats_init(test_verify_stats *stats)
+{
+	test_histogram_init(&stats->verify, "verify");
+	test_histogram_init(&stats->attach, "attach");
+	test_histogram_init(&stats->map, "map");
+	test_histogram_init(&stats->unmap, "unmap");
+	test_histogram_init(&stats->detach, "detach");
+}
+
+void test_verify_stats_merge(test_verify_stats *dst, const test_verify_stats *src)
+{
+	test_histogram_merge(&dst->verify, &src->verify);
+	test_histogram_merge(&dst->attach, &src->attach);
+	test_histogram_merge(&dst->map, &src->map);
+	test_histogram_merge(&dst->unmap, &src->unmap);
+	test_histogram_merge(&dst->detach, &src->detach);
+}
+
+void test_latency_stats_init(test_latency_stats *stats)
+{
+	test_histogram_init(&stats->alloc, "alloc");
+	test_histogram_init(&stats->share, "share");
+	test_verify_stats_init(&stats->dma);
+	test_histogram_init(&stats->free, "free");
+	test_histogram_init(&stats->mmap, "mmap");
+	test_histogram_init(&stats->munmap, "munmap");
+	test_histogram_init(&stats->fragment, "fragment");
+}
+
+void test_latency_stats_merge(test_latency_stats *dst, const test_latency_stats *src)
+{
+	test_histogram_merge(&dst->alloc, &src->alloc);
+	test_histogram_merge(&dst->share, &src->share);
+	test_verify_stats_merge(&dst->dma, &src->dma);
+	test_histogram_merge(&dst->free, &src->free);
+	test_histogram_merge(&dst->mmap, &src->mmap);
+	test_histogram_merge(&dst->munmap, &src->munmap);
+	test_histogram_merge(&dst->fragment, &src->fragment);
+}
+
+void test_latency_stats_print(const test_latency_stats *stats, bool dump_buckets)
+{
+	const test_histogram *hists[] = {&stats->alloc, &stats->share, &stats->dma.verify,
+			&stats->dma.attach, &stats->dma.map, &stats->dma.unmap, &stats->dma.detach, &stats->free,
+			&stats->mmap, &stats->munmap, &stats->fragment};
+	size_t i;
+
+	for (i = 0; i < sizeof(hists) / sizeof(hists[0]); i++)
+	{
+		test_histogram_print(hists[i]);
+	}
+
+	if (!dump_buckets)
+	{
+		return;
+	}
+
+	for (i = 0; i < sizeof(hists) / sizeof(hists[0]); i++)
+	{
+		if (0 != hists[i]->total)
+		{
+			test_histogram_dump(hists[i]);
+		}
+	}
+}
+
+static test_latency_stats *test_get_latency_stats()
+{
+	return NULL != thread_latency_stats ? thread_latency_stats : &latency_stats;
+}
+
+int test_initialize()
+{
+	ion_client = ion_open();
+
+	if (ion_client < 0)
+	{
+		AERR("ion_open failed.");
+		return -1;
+	}
+
+	test_handle = open(TEST_DEV_PATH, O_RDWR);
+
+	if (test_handle < 0)
+	{
+		AERR("Open test device failed.");
+
+		if (0 != ion_close(ion_client))
+		{
+			AERR("Close ion_client failed in test_initialize.");
+		}
+
+		return -1;
+	}
+
+	return 0;
+}
+
+int test_uninitialize()
+{
+	if (0 != ion_close(ion_client))
+	{
+		AERR("Failed to close ion_client");
+	}
+	if (0 != close(test_handle))
+	{
+		AERR("Failed to close test_handle");
+	}
+
+	return 0;
+}
+
+int test_allocate_from_heap(size_t size, unsigned int heap_mask, unsigned int flags, test_latency_stats *stats)
+{
+	ion_user_handle_t ion_hnd = -1;
+	int shared_fd, ret;
+	uint64_t start_ns;
+
+	if (size <=0)
+	{
+		return -1;
+	}
+
+	start_ns = test_get_time_ns();
+	ret = ion_alloc(ion_client, size, 0, heap_mask, flags, &ion_hnd);
+	test_histogram_record(&stats->alloc, test_get_time_ns() - start_ns);
+
+	if (ret < 0)
+	{
+		AERR("ion_alloc failed");
+		return -1;
+	}
+
+	start_ns = test_get_time_ns();
+	ret = ion_share(ion_client, ion_hnd, &shared_fd );
+	test_histogram_record(&stats->share, test_get_time_ns() - start_ns);
+	if (0 != ret)
+	{
+		AERR("ion_share failed");
+		shared_fd = -1;
+	}
+
+	ret = ion_free(ion_client, ion_hnd);
+	if (0 != ret)
+	{
+		AERR("ion_free failed");
+
+		if (-1 != shared_fd && 0 != close(shared_fd))
+		{
+			AERR("Close shared_fd failed in test_allocate_from_heap.");
+		}
+
+		return -1;
+	}
+
+	return shared_fd;
+}
+
+int test_allocate_from_CPA(size_t size, unsigned int flags = 0)
+{
+#if defined(ION_HEAP_TYPE_COMPOUND_PAGE_MASK)
+	return test_allocate_from_heap(size, ION_HEAP_TYPE_COMPOUND_PAGE_MASK, flags, test_get_latency_stats());
+#else
+	TEST_IGNORE(size);
+	TEST_IGNORE(flags);
+	AERR("Compound page heap mask not defined");
+	return -1;
+#endif
+}
+
+/* 4KB page backed buffer, used as the baseline CPA is compared against. */
+int test_allocate_from_system_heap(size_t size, unsigned int flags = 0)
+{
+#if defined(ION_HEAP_SYSTEM_MASK)
+	return test_allocate_from_heap(size, ION_HEAP_SYSTEM_MASK, flags, &system_latency_stats);
+#else
+	TEST_IGNORE(size);
+	TEST_IGNORE(flags);
+	AERR("System heap mask not defined");
+	return -1;
+#endif
+}
+
+void test_free_CPA_mem(int fd, test_latency_stats *stats = NULL)
+{
+	uint64_t start_ns;
+	int ret;
+
+	if (fd <= 0)
+	{
+		return;
+	}
+
+	/* the ion handle is already gone, closing the last fd frees the buffer. */
+	start_ns = test_get_time_ns();
+	ret = close(fd);
+	if (NULL == stats)
+	{
+		stats = test_get_latency_stats();
+	}
+	test_histogram_record(&stats->free, test_get_time_ns() - start_ns);
+
+	if (0 != ret)
+	{
+		AERR("Close fd failed in test_free_CPA_mem.");
+	}
+}
+
+/*
+ * Verify the buffer in the test module. args also returns the number of
+ * scatterlist segments and the dma-buf attach/map/unmap/detach times.
+ * The times are recorded into stats, or the calling thread's CPA stats.
+ */
+bool test_verify_allocated_buffer(int shared_fd, int mem_size, test_verify_args &args,
+		test_verify_stats *stats = NULL)
+{
+	uint64_t start_ns;
+	int ret;
+
+	if (NULL == stats)
+	{
+		stats = &test_get_latency_stats()->dma;
+	}
+
+	if (shared_fd <= 0)
+	{
+		AERR("Invalid shared fd.");
+		return false;
+	}
+
+	args.shared_fd = shared_fd;
+	args.mem_size = mem_size;
+
+	start_ns = test_get_time_ns();
+	ret = ioctl(test_handle, TEST_IOCTL_VERIFY_CPA, &args);
+	test_histogram_record(&stats->verify, test_get_time_ns() - start_ns);
+
+	if (0 != ret)
+	{
+		AERR("ioctl: test verify failed.");
+		return false;
+	}
+
+	test_histogram_record(&stats->attach, args.attach_ns);
+	test_histogram_record(&stats->map, args.map_ns);
+	test_histogram_record(&stats->unmap, args.unmap_ns);
+	test_histogram_record(&stats->detach, args.detach_ns);
+
+	return (bool)args.verify_result;
+}
+
+bool test_verify_allocated_buffer(int shared_fd, int mem_size)
+{
+	test_verify_args args;
+
+	return test_verify_allocated_buffer(shared_fd, mem_size, args);
+}
+
+#define TEST_MAX_VERIFY_THREADS 64
+
+typedef struct {
+	const int *fds;
+	bool *results;
+	int num;
+	int mem_size;
+	const int *mem_sizes;
+	int next;
+} test_verify_job;
+
+/* workers only verify, so they only keep the verify histograms. */
+typedef struct {
+	test_verify_job *job;
+	test_verify_stats stats;
+} test_verify_worker_args;
+
+/* verify outstanding buffers of job, recording into stats when not NULL. */
+static void test_verify_job_run(test_verify_job *job, test_verify_stats *stats)
+{
+	test_verify_args args;
+	int i;
+
+	while ((i = __sync_fetch_and_add(&job->next, 1)) < job->num)
+	{
+		job->results[i] = test_verify_allocated_buffer(job->fds[i],
+				NULL != job->mem_sizes ? job->mem_sizes[i] : job->mem_size, args, stats);
+	}
+}
+
+static void *test_verify_worker(void *data)
+{
+	test_verify_worker_args *args = (test_verify_worker_args *)data;
+
+	test_verify_job_run(args->job, &args->stats);
+
+	return NULL;
+}
+
+/*
+ * Verify num buffers with one worker thread per online CPU, each worker
+ * picking the next outstanding fd. The verify ioctl takes no lock in the
+ * test module, so the calls run in parallel. Per-buffer results are stored
+ * in results, the number of failed buffers is returned. Buffers of
+ * different sizes can be verified together by passing mem_sizes.
+ */
+int test_verify_allocated_buffers_parallel(const int *fds, int num, int mem_size, bool *results, int &thread_num,
+		const int *mem_sizes = NULL)
+{
+	pthread_t threads[TEST_MAX_VERIFY_THREADS];
+	test_verify_worker_args *worker_args;
+	test_verify_job job;
+	int i, failed = 0;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	job.fds = fds;
+	job.results = results;
+	job.num = num;
+	job.mem_size = mem_size;
+	job.mem_sizes = mem_sizes;
+	job.next = 0;
+
+	for (i = 0; i < num; i++)
+	{
+		results[i] = false;
+	}
+
+	if (cpus > num)
+	{
+		cpus = num;
+	}
+	if (cpus > TEST_MAX_VERIFY_THREADS)
+	{
+		cpus = TEST_MAX_VERIFY_THREADS;
+	}
+	if (cpus < 1)
+	{
+		cpus = 1;
+	}
+
+	worker_args = (test_verify_worker_args *)malloc(cpus * sizeof(test_verify_worker_args));
+	if (NULL == worker_args)
+	{
+		AERR("Failed to allocate verify worker arguments.");
+		cpus = 0;
+	}
+
+	thread_num = 0;
+	for (i = 0; i < cpus; i++)
+	{
+		worker_args[i].job = &job;
+		test_verify_stats_init(&worker_args[i].stats);
+
+		if (0 != pthread_create(&threads[thread_num], NULL, test_verify_worker, &worker_args[i]))
+		{
+			AERR("pthread_create failed for verify worker %d.", i);
+			break;
+		}
+		thread_num++;
+	}
+
+	/* no worker could be started, verify on the calling thread. */
+	if (0 == thread_num)
+	{
+		test_verify_job_run(&job, NULL);
+	}
+
+	for (i = 0; i < thread_num; i++)
+	{
+		pthread_join(threads[i], NULL);
+		test_verify_stats_merge(&test_get_latency_stats()->dma, &worker_args[i].stats);
+	}
+
+	free(worker_args);
+
+	for (i = 0; i < num; i++)
+	{
+		if (!results[i])
+		{
+			failed++;
+		}
+	}
+
+	return failed;
+}
+
+typedef struct {
+	int cpu;
+	void (*fn)(void *data);
+	void *data;
+	test_latency_stats stats;
+} test_pinned_thread;
+
+static void *test_pinned_thread_main(void *data)
+{
+	test_pinned_thread *thread = (test_pinned_thread *)data;
+	cpu_set_t cpus;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(thread->cpu, &cpus);
+
+	if (0 != sched_setaffinity(0, sizeof(cpus), &cpus))
+	{
+		AERR("Failed to pin thread to CPU %d: %s", thread->cpu, strerror(errno));
+	}
+
+	thread_latency_stats = &thread->stats;
+	thread->fn(thread->data);
+	thread_latency_stats = NULL;
+
+	return NULL;
+}
+
+/*
+ * Run fn(data) on a new thread pinned to cpu and wait for it. Latency
+ * recorded by the thread is merged into latency_stats afterwards.
+ */
+bool test_run_pinned(int cpu, void (*fn)(void *data), void *data)
+{
+	test_pinned_thread *thread = (test_pinned_thread *)malloc(sizeof(test_pinned_thread));
+	pthread_t tid;
+
+	if (NULL == thread)
+	{
+		AERR("Failed to allocate pinned thread.");
+		return false;
+	}
+
+	thread->cpu = cpu;
+	thread->fn = fn;
+	thread->data = data;
+	test_latency_stats_init(&thread->stats);
+
+	if (0 != pthread_create(&tid, NULL, test_pinned_thread_main, thread))
+	{
+		AERR("pthread_create failed for CPU %d.", cpu);
+		free(thread);
+		return false;
+	}
+
+	pthread_join(tid, NULL);
+	test_latency_stats_merge(&latency_stats, &thread->stats);
+	free(thread);
+
+	return true;
+}
+
+bool test_start_simulate_memory_fragment(int &free_pages, int &allocated_pages, int &simulate_page_unit_size)
+{
+	test_simulate_args args;
+	uint64_t start_ns;
+	int ret;
+
+	start_ns = test_get_time_ns();
+	ret = ioctl(test_handle, TEST_IOCTL_START_SIMULATE_FRAGMENT, &args);
+	test_histogram_record(&test_get_latency_stats()->fragment, test_get_time_ns() - start_ns);
+
+	if (0 != ret)
+	{
+		AERR("ioctl: test start simulate failed.");
+		return false;
+	}
+
+	free_pages = args.system_free_pages;
+	allocated_pages = args.test_allocated_page;
+	simulate_page_unit_size = args.simulate_page_unit_size;
+
+	return args.simulate_result;
+}
+
+bool test_free_one_simulate_page_unit(int &free_pages, int &allocated_pages)
+{
+	test_simulate_args args;
+
+	if (0 != ioctl(test_handle, TEST_IOCTL_FREE_ONE_PAGE_UNIT, &args))
+	{
+		AERR("ioctl: test free simulate failed.");
+		return false;
+	}
+
+	free_pages = args.system_free_pages;
+	allocated_pages = args.test_allocated_page;
+
+	return args.simulate_result;
+}
+
+bool test_stop_simulate_memory_fragment()
+{
+	test_simulate_args args;
+
+	if (0 != ioctl(test_handle, TEST_IOCTL_STOP_SIMULATE_FRAGMENT, &args))
+	{
+		AERR("ioctl: test stop simulate failed.");
+		return false;
+	}
+
+	return args.simulate_result;
+}
+
+bool test_set_fault_inject(int interval, int probability, int delay_us, int min_order, int &injected_failures)
+{
+	test_fault_inject_args args;
+
+	args.fail_interval = interval;
+	args.fail_probability = probability;
+	args.delay_us = delay_us;
+	args.min_order = min_order;
+	args.injected_failures = 0;
+
+	if (0 != ioctl(test_handle, TEST_IOCTL_SET_FAULT_INJECT, &args))
+	{
+		AERR("ioctl: test set fault inject failed.");
+		return false;
+	}
+
+	injected_failures = args.injected_failures;
+
+	return true;
+}
+
+bool test_alloc_pages_benchmark(int order, int gfp_mode, int alloc_times, test_alloc_bench_args &args)
+{
+	args.order = order;
+	args.gfp_mode = gfp_mode;
+	args.alloc_times = alloc_times;
+
+	if (0 != ioctl(test_handle, TEST_IOCTL_ALLOC_PAGES_BENCH, &args))
+	{
+		AERR("ioctl: test alloc pages benchmark failed.");
+		return false;
+	}
+
+	return true;
+}
+
+#define TEST_FAIL_PAGE_ALLOC_DIR "/sys/kernel/debug/fail_page_alloc/"
+
+static bool test_write_file(const char *path, const char *value)
+{
+	int fd = open(path, O_WRONLY);
+	bool ret;
+
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	ret = (ssize_t)strlen(value) == write(fd, value, strlen(value));
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * Configure the kernel's fail_page_alloc fault injection (needs
+ * CONFIG_FAIL_PAGE_ALLOC and debugfs), so the page allocations CPA makes
+ * in this process context fail. task-filter limits the failures to this
+ * process, sleeping allocations are not ignored since CPA may reclaim.
+ */
+bool test_set_page_alloc_fault(int interval, int probability, int min_order)
+{
+	char value[16];
+	bool ret = true;
+
+	if (0 >= probability)
+	{
+		ret = test_write_file("/proc/self/make-it-fail", "0");
+		return test_write_file(TEST_FAIL_PAGE_ALLOC_DIR "probability", "0") && ret;
+	}
+
+	snprintf(value, sizeof(value), "%d", interval);
+	ret = ret && test_write_file(TEST_FAIL_PAGE_ALLOC_DIR "interval", value);
+	snprintf(value, sizeof(value), "%d", min_order);
+	ret = ret && test_write_file(TEST_FAIL_PAGE_ALLOC_DIR "min-order", value);
+	ret = ret && test_write_file(TEST_FAIL_PAGE_ALLOC_DIR "times", "-1");
+	ret = ret && test_write_file(TEST_FAIL_PAGE_ALLOC_DIR "ignore-gfp-wait", "N");
+	ret = ret && test_write_file(TEST_FAIL_PAGE_ALLOC_DIR "ignore-gfp-highmem", "N");
+	ret = ret && test_write_file(TEST_FAIL_PAGE_ALLOC_DIR "task-filter", "Y");
+	ret = ret && test_write_file("/proc/self/make-it-fail", "1");
+	snprintf(value, sizeof(value), "%d", probability);
+	ret = ret && test_write_file(TEST_FAIL_PAGE_ALLOC_DIR "probability", value);
+
+	/* never leave the process marked to fail with a half applied setup. */
+	if (!ret)
+	{
+		test_write_file("/proc/self/make-it-fail", "0");
+		test_write_file(TEST_FAIL_PAGE_ALLOC_DIR "probability", "0");
+	}
+
+	return ret;
+}
+
+
+#define TEST_ALLOC_NUM 5
+#define TEST_ALLOC_FAIL_TIMES 200
+#define TEST_ALLOC_DEFAULT_SIZE 2*1024*1024
+#define TEST_MAX_BUFFER_NUM 8192    //support 16GB maximum system memory
+
+/* pre-defined memory size we want to test. */
+static size_t mem_size_arr[TEST_ALLOC_NUM] = {1024, 1024*1024, 2*1024*1024, 2*1024*1014+3*1024, 64*1024*1024};
+
+static bool verify_results[TEST_MAX_BUFFER_NUM];
+
+#define TEST_MMAP_SIZE_NUM 8
+#define TEST_MMAP_ITERATIONS 10
+
+/* buffer sizes used to compare CPU mapping cost of CPA and system heap. */
+static size_t mmap_size_arr[TEST_MMAP_SIZE_NUM] = {64*1024, 1024*1024, 2*1024*1024, 4*1024*1024,
+		8*1024*1024, 16*1024*1024, 32*1024*1024, 64*1024*1024};
+
+typedef struct {
+	uint64_t mmap_ns;
+	uint64_t touch_ns;
+	uint64_t populate_ns;
+	uint64_t munmap_ns;
+	long faults;
+	int runs;
+	int failed;
+} test_mmap_cost;
+
+static long test_get_page_faults()
+{
+	struct rusage usage;
+
+	if (0 != getrusage(RUSAGE_SELF, &usage))
+	{
+		return 0;
+	}
+
+	return usage.ru_minflt + usage.ru_majflt;
+}
+
+/*
+ * Map the buffer behind fd and write one byte per CPU page to count the
+ * faults taken on first touch, then unmap it. The buffer is mapped a
+ * second time with MAP_POPULATE to time a mapping that is fully set up
+ * at mmap() time. cost is only updated when both mappings succeed.
+ */
+bool test_measure_mmap_cost(int fd, size_t size, test_mmap_cost &cost, test_latency_stats *stats)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	volatile char *ptr;
+	void *addr;
+	size_t offset;
+	long faults;
+	uint64_t start_ns_first, start_ns, mapped_ns, touched_ns, unmapped_ns, populated_ns;
+
+	faults = test_get_page_faults();
+	start_ns = start_ns_first = test_get_time_ns();
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (MAP_FAILED == addr)
+	{
+		AERR("mmap of %zu bytes failed: %s", size, strerror(errno));
+		return false;
+	}
+
+	mapped_ns = test_get_time_ns();
+	test_histogram_record(&stats->mmap, mapped_ns - start_ns);
+
+	ptr = (volatile char *)addr;
+	for (offset = 0; offset < size; offset += page_size)
+	{
+		ptr[offset] = 0;
+	}
+
+	touched_ns = test_get_time_ns();
+	faults = test_get_page_faults() - faults;
+
+	munmap(addr, size);
+	unmapped_ns = test_get_time_ns();
+	test_histogram_record(&stats->munmap, unmapped_ns - touched_ns);
+
+	start_ns = test_get_time_ns();
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+	if (MAP_FAILED == addr)
+	{
+		AERR("mmap(MAP_POPULATE) of %zu bytes failed: %s", size, strerror(errno));
+		return false;
+	}
+	populated_ns = test_get_time_ns();
+
+	munmap(addr, size);
+
+	cost.faults += faults;
+	cost.mmap_ns += mapped_ns - start_ns_first;
+	cost.touch_ns += touched_ns - mapped_ns;
+	cost.munmap_ns += unmapped_ns - touched_ns;
+	cost.populate_ns += populated_ns - start_ns;
+	cost.runs++;
+
+	return true;
+}
+
+static void test_print_mmap_cost(const char *heap, const char *mapping, size_t size, const test_mmap_cost &cost)
+{
+	if (0 == cost.runs)
+	{
+		printf("        %8zu  %-6s  %-8s  allocation or mapping failed\n", size>>10, heap, mapping);
+		return;
+	}
+
+	printf("        %8zu  %-6s  %-8s  %8ld  %10" PRIu64 "  %10" PRIu64 "  %10" PRIu64 "  %10" PRIu64 "  %6d\n",
+			size>>10, heap, mapping, cost.faults / cost.runs,
+			cost.mmap_ns / cost.runs / 1000, cost.touch_ns / cost.runs / 1000,
+			cost.populate_ns / cost.runs / 1000, cost.munmap_ns / cost.runs / 1000, cost.failed);
+}
+
+#define TEST_MMAP_MAPPING_NUM 2
+
+/*
+ * Uncached ION buffers are mapped with remap_pfn_range() inside mmap(), so
+ * first touch takes no fault and MAP_POPULATE has nothing to do. Cached
+ * buffers use ION's fault-on-touch mapping, one fault per CPU page.
+ */
+static const struct {
+	const char *name;
+	unsigned int flags;
+} mmap_mapping_arr[TEST_MMAP_MAPPING_NUM] = {
+	{"uncached", 0},
+#if defined(ION_FLAG_CACHED)
+	{"cached", ION_FLAG_CACHED},
+#else
+	{NULL, 0},
+#endif
+};
+
+static void test_measure_mmap_cost_iterations(bool cpa, size_t size, unsigned int flags, test_mmap_cost &cost)
+{
+	test_latency_stats *stats = cpa ? test_get_latency_stats() : &system_latency_stats;
+	int i, fd;
+
+	memset(&cost, 0, sizeof(cost));
+
+	for (i = 0; i < TEST_MMAP_ITERATIONS; i++)
+	{
+		fd = cpa ? test_allocate_from_CPA(size, flags) : test_allocate_from_system_heap(size, flags);
+		if (fd <= 0)
+		{
+			cost.failed++;
+			continue;
+		}
+
+		if (!test_measure_mmap_cost(fd, size, cost, stats))
+		{
+			cost.failed++;
+		}
+
+		test_free_CPA_mem(fd, stats);
+	}
+}
+
+/*
+ * Compare CPU mapping cost of CPA buffers against system heap buffers of
+ * the same size, for uncached and cached buffers. Large pages should need
+ * fewer faults and cheaper page table set up and tear down.
+ */
+void test_mmap_cost_benchmark()
+{
+	test_mmap_cost cpa_cost, system_cost;
+	int i, j;
+
+	printf("    >>> Average over %d runs, times in us.\n", TEST_MMAP_ITERATIONS);
+	printf("    >>> Uncached buffers are fully mapped by mmap(): faults are 0 and populate is a no-op by construction.\n");
+	printf("        %8s  %-6s  %-8s  %8s  %10s  %10s  %10s  %10s  %6s\n",
+			"size(KB)", "heap", "mapping", "faults", "mmap", "touch", "populate", "munmap", "failed");
+
+	for (i = 0; i < TEST_MMAP_SIZE_NUM; i++)
+	{
+		for (j = 0; j < TEST_MMAP_MAPPING_NUM; j++)
+		{
+			if (NULL == mmap_mapping_arr[j].name)
+			{
+				continue;
+			}
+
+			test_measure_mmap_cost_iterations(true, mmap_size_arr[i], mmap_mapping_arr[j].flags, cpa_cost);
+			test_measure_mmap_cost_iterations(false, mmap_size_arr[i], mmap_mapping_arr[j].flags, system_cost);
+
+			test_print_mmap_cost("cpa", mmap_mapping_arr[j].name, mmap_size_arr[i], cpa_cost);
+			test_print_mmap_cost("system", mmap_mapping_arr[j].name, mmap_size_arr[i], system_cost);
+		}
+	}
+}
+
+#define TEST_KBENCH_ALLOC_TIMES 200
+#define TEST_KBENCH_MODE_NUM 4
+
+static const struct {
+	const char *name;
+	int gfp_mode;
+} kbench_mode_arr[TEST_KBENCH_MODE_NUM] = {
+	{"no reclaim", 0},
+	{"reclaim", TEST_ALLOC_BENCH_RECLAIM},
+	{"compact", TEST_ALLOC_BENCH_RECLAIM | TEST_ALLOC_BENCH_COMPACT},
+	{"noretry", TEST_ALLOC_BENCH_RECLAIM | TEST_ALLOC_BENCH_COMPACT | TEST_ALLOC_BENCH_NORETRY},
+};
+
+/* upper bound of the log2 bucket holding the given percentile. */
+static uint64_t test_alloc_bench_percentile(const test_alloc_bench_args &args, double percentile)
+{
+	uint64_t target = (uint64_t)(percentile / 100.0 * args.alloc_times + 0.5);
+	uint64_t seen = 0;
+	int i;
+
+	if (target < 1)
+	{
+		target = 1;
+	}
+
+	for (i = 0; i < TEST_ALLOC_BENCH_BUCKETS; i++)
+	{
+		seen += args.latency_hist[i];
+		if (seen >= target)
+		{
+			return i > 0 ? ((uint64_t)1 << i) - 1 : 0;
+		}
+	}
+
+	return args.max_ns;
+}
+
+static void test_print_alloc_bench(const char *name, const test_alloc_bench_args &args)
+{
+	int i;
+
+	printf("        %-10s  %4d/%-4d  min %9.1f  mean %9.1f  p50 <=%9.1f  p99 <=%9.1f  max %9.1f us\n",
+			name, args.success_times, args.alloc_times, args.min_ns / 1000.0,
+			(double)args.total_ns / args.alloc_times / 1000.0,
+			test_alloc_bench_percentile(args, 50) / 1000.0,
+			test_alloc_bench_percentile(args, 99) / 1000.0,
+			args.max_ns / 1000.0);
+
+	if (!dump_histograms)
+	{
+		return;
+	}
+
+	for (i = 0; i < TEST_ALLOC_BENCH_BUCKETS; i++)
+	{
+		if (0 != args.latency_hist[i])
+		{
+			printf("        %s %" PRIu64 " %" PRIu64 " %" PRIu64 "\n", name,
+					i > 0 ? (uint64_t)1 << (i - 1) : 0, i > 0 ? ((uint64_t)1 << i) - 1 : 0,
+					(uint64_t)args.latency_hist[i]);
+		}
+	}
+}
+
+static void test_alloc_pages_benchmark_modes(int order)
+{
+	test_alloc_bench_args args;
+	int i;
+
+	printf("        %-10s  %9s  (success/attempts, latency per alloc_pages() call)\n", "gfp", "success");
+
+	for (i = 0; i < TEST_KBENCH_MODE_NUM; i++)
+	{
+		if (test_alloc_pages_benchmark(order, kbench_mode_arr[i].gfp_mode | TEST_ALLOC_BENCH_HOLD,
+				TEST_KBENCH_ALLOC_TIMES, args))
+		{
+			test_print_alloc_bench(kbench_mode_arr[i].name, args);
+		}
+	}
+}
+
+/*
+ * Time the alloc_pages() calls CPA's fill thread and slow path depend on,
+ * with each reclaim/compaction policy, before and under the simulated
+ * memory fragmentation.
+ */
+void test_kernel_alloc_benchmark(int order)
+{
+	int system_free_pages, test_allocated_pages, simulate_page_unit_size;
+
+	printf("    >>> Allocate and hold %d order-%d pages in test-cpa module.\n", TEST_KBENCH_ALLOC_TIMES, order);
+	test_alloc_pages_benchmark_modes(order);
+
+	test_start_simulate_memory_fragment(system_free_pages, test_allocated_pages, simulate_page_unit_size);
+	printf("\n    >>> After simulate memory fragment, system free memory: %d MB, test allocated memory: %d MB.\n",
+			system_free_pages>>8, test_allocated_pages>>8);
+	test_alloc_pages_benchmark_modes(order);
+	test_stop_simulate_memory_fragment();
+}
+
+#define TEST_FAULT_PAGE_ORDER 9
+
+/*
+ * Allocate 2MB buffers from CPA while every Nth order-9 page allocation in
+ * this process fails with the given probability, and check that CPA fails
+ * gracefully. Then run the fragmentation simulator with the same faults
+ * (and delay) injected in the test module, and time order-9 alloc_pages()
+ * calls in the module with them still injected.
+ */
+void test_fault_injection(int interval, int probability, int delay_us)
+{
+	int allocated_buffer_handle[TEST_ALLOC_FAIL_TIMES];
+	int allocated_buffer_num = 0;
+	int failed_times = 0, verify_failed = 0;
+	int injected_failures;
+	int system_free_pages, test_allocated_pages, simulate_page_unit_size;
+	uint64_t start_ns, latency_ns;
+	test_histogram cpa_latency;
+	int i;
+
+	test_histogram_init(&cpa_latency, "cpa alloc");
+
+	printf("    >>> Every %d order-%d page allocation(s) fails with %d%% probability, %d us delay.\n",
+			interval, TEST_FAULT_PAGE_ORDER, probability, delay_us);
+
+	if (0 == probability)
+	{
+		printf("    >>> No failure requested, CPA allocations are not affected.\n");
+	}
+	else if (!test_set_page_alloc_fault(interval, probability, TEST_FAULT_PAGE_ORDER))
+	{
+		printf("    >>> fail_page_alloc is not available, CPA allocations are not affected.\n");
+	}
+
+	for (i = 0; i < TEST_ALLOC_FAIL_TIMES; i++)
+	{
+		int tmp_fd;
+
+		start_ns = test_get_time_ns();
+		tmp_fd = test_allocate_from_CPA(TEST_ALLOC_DEFAULT_SIZE);
+		test_histogram_record(&cpa_latency, test_get_time_ns() - start_ns);
+
+		if (tmp_fd <= 0)
+		{
+			failed_times++;
+			continue;
+		}
+
+		if (!test_verify_allocated_buffer(tmp_fd, TEST_ALLOC_DEFAULT_SIZE))
+		{
+			verify_failed++;
+		}
+
+		allocated_buffer_handle[allocated_buffer_num] = tmp_fd;
+		allocated_buffer_num++;
+	}
+
+	if (0 != probability)
+	{
+		test_set_page_alloc_fault(0, 0, TEST_FAULT_PAGE_ORDER);
+	}
+
+	for (i = 0; i < allocated_buffer_num; i++)
+	{
+		test_free_CPA_mem(allocated_buffer_handle[i]);
+	}
+
+	printf("    >>> Allocate 2MB from CPA %d times: %d failed, %d failed to verify.\n",
+			TEST_ALLOC_FAIL_TIMES, failed_times, verify_failed);
+	test_histogram_print(&cpa_latency);
+
+	/* the simulator allocates small pages, apply the faults to every order. */
+	if (!test_set_fault_inject(interval, probability, delay_us, 0, injected_failures))
+	{
+		return;
+	}
+
+	start_ns = test_get_time_ns();
+	test_start_simulate_memory_fragment(system_free_pages, test_allocated_pages, simulate_page_unit_size);
+	latency_ns = test_get_time_ns() - start_ns;
+
+	/* setting the faults again returns and resets the injected count. */
+	test_set_fault_inject(interval, probability, delay_us, 0, injected_failures);
+
+	printf("    >>> Simulate memory fragment took %" PRIu64 " ms, %d failures injected, test allocated memory: %d MB.\n",
+			latency_ns / 1000000, injected_failures, test_allocated_pages>>8);
+
+	printf("\n    >>> Allocate and hold %d order-%d pages in test-cpa module with the faults injected.\n",
+			TEST_KBENCH_ALLOC_TIMES, TEST_FAULT_PAGE_ORDER);
+	test_alloc_pages_benchmark_modes(TEST_FAULT_PAGE_ORDER);
+
+	test_set_fault_inject(0, 0, 0, 0, injected_failures);
+	test_stop_simulate_memory_fragment();
+
+	printf("    >>> %d failures injected into the alloc_pages() calls above.\n", injected_failures);
+}
+
+#define TEST_DMA_MAP_ITERATIONS 20
+
+typedef struct {
+	test_histogram attach;
+	test_histogram map;
+	test_histogram unmap;
+	test_histogram detach;
+	int nents;
+} test_dma_map_cost;
+
+static void test_measure_dma_map_cost(int fd, size_t size, test_dma_map_cost &cost, test_latency_stats *stats)
+{
+	test_verify_args args;
+	int i;
+
+	for (i = 0; i < TEST_DMA_MAP_ITERATIONS; i++)
+	{
+		memset(&args, 0, sizeof(args));
+		test_verify_allocated_buffer(fd, size, args, &stats->dma);
+
+		if (0 == args.nents)
+		{
+			/* the buffer could not be attached or mapped. */
+			return;
+		}
+
+		cost.nents = args.nents;
+		test_histogram_record(&cost.attach, args.attach_ns);
+		test_histogram_record(&cost.map, args.map_ns);
+		test_histogram_record(&cost.unmap, args.unmap_ns);
+		test_histogram_record(&cost.detach, args.detach_ns);
+	}
+}
+
+static void test_print_dma_map_cost(const char *heap, size_t size, const test_dma_map_cost &cost)
+{
+	if (0 == cost.map.total)
+	{
+		printf("        %8zu  %-6s  allocation or mapping failed\n", size>>10, heap);
+		return;
+	}
+
+	printf("        %8zu  %-6s  %6d  %10.1f  %10.1f  %10.1f  %10.1f  %10.1f\n",
+			size>>10, heap, cost.nents,
+			test_histogram_percentile(&cost.attach, 50) / 1000.0,
+			test_histogram_percentile(&cost.map, 50) / 1000.0,
+			test_histogram_percentile(&cost.map, 99) / 1000.0,
+			test_histogram_percentile(&cost.unmap, 50) / 1000.0,
+			test_histogram_percentile(&cost.detach, 50) / 1000.0);
+}
+
+/*
+ * Compare the dma-buf attach/map/unmap/detach cost of CPA buffers against
+ * system heap buffers of the same size. Fewer, larger scatterlist segments
+ * should make mapping the buffer for a device cheaper.
+ */
+void test_dma_map_cost_benchmark()
+{
+	test_dma_map_cost cpa_cost, system_cost;
+	int i, fd;
+
+	printf("    >>> %d mappings per buffer, median times in us unless noted.\n", TEST_DMA_MAP_ITERATIONS);
+	printf("        %8s  %-6s  %6s  %10s  %10s  %10s  %10s  %10s\n",
+			"size(KB)", "heap", "nents", "attach", "map", "map p99", "unmap", "detach");
+
+	for (i = 0; i < TEST_MMAP_SIZE_NUM; i++)
+	{
+		test_histogram_init(&cpa_cost.attach, "attach");
+		test_histogram_init(&cpa_cost.map, "map");
+		test_histogram_init(&cpa_cost.unmap, "unmap");
+		test_histogram_init(&cpa_cost.detach, "detach");
+		cpa_cost.nents = 0;
+		system_cost = cpa_cost;
+
+		fd = test_allocate_from_CPA(mmap_size_arr[i]);
+		if (fd > 0)
+		{
+			test_measure_dma_map_cost(fd, mmap_size_arr[i], cpa_cost, test_get_latency_stats());
+			test_free_CPA_mem(fd);
+		}
+
+		fd = test_allocate_from_system_heap(mmap_size_arr[i]);
+		if (fd > 0)
+		{
+			test_measure_dma_map_cost(fd, mmap_size_arr[i], system_cost, &system_latency_stats);
+			test_free_CPA_mem(fd, &system_latency_stats);
+		}
+
+		test_print_dma_map_cost("cpa", mmap_size_arr[i], cpa_cost);
+		test_print_dma_map_cost("system", mmap_size_arr[i], system_cost);
+	}
+}
+
+#define TEST_NUMA_NODE_DIR "/sys/devices/system/node/"
+#define TEST_NUMA_NODE_SCAN_MAX 1024	/* MAX_NUMNODES with the largest NODES_SHIFT. */
+#define TEST_NUMA_BUFFER_NUM 4
+#define TEST_NUMA_BUFFER_SIZE (16*1024*1024)
+#define TEST_NUMA_BANDWIDTH_ROUNDS 4
+
+/*
+ * Uncached ION buffers are mapped write-combined, which would measure
+ * uncached access rather than the cached bandwidth node locality affects.
+ */
+#if defined(ION_FLAG_CACHED)
+#define TEST_NUMA_BUFFER_FLAGS ION_FLAG_CACHED
+#define TEST_NUMA_BUFFER_MAPPING "cached"
+#else
+#define TEST_NUMA_BUFFER_FLAGS 0
+#define TEST_NUMA_BUFFER_MAPPING "uncached"
+#endif
+
+/*
+ * Find the NUMA nodes with CPUs and the first CPU of each. A kernel without
+ * CONFIG_NUMA is reported as a single node 0. Nodes with CPUs whose id is
+ * TEST_MAX_NUMA_NODES or more are only counted in skipped.
+ */
+static int test_get_numa_nodes(int *node_ids, int *node_cpus, int &skipped)
+{
+	char path[64], cpulist[256];
+	int node, fd, len, node_num = 0;
+
+	skipped = 0;
+
+	for (node = 0; node < TEST_NUMA_NODE_SCAN_MAX; node++)
+	{
+		snprintf(path, sizeof(path), TEST_NUMA_NODE_DIR "node%d/cpulist", node);
+
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+		{
+			continue;
+		}
+
+		len = read(fd, cpulist, sizeof(cpulist) - 1);
+		close(fd);
+
+		/* memory only nodes have an empty cpulist. */
+		if (len <= 0 || cpulist[0] < '0' || cpulist[0] > '9')
+		{
+			continue;
+		}
+
+		if (node >= TEST_MAX_NUMA_NODES)
+		{
+			skipped++;
+			continue;
+		}
+
+		cpulist[len] = '\0';
+		node_ids[node_num] = node;
+		node_cpus[node_num] = atoi(cpulist);
+		node_num++;
+	}
+
+	if (0 == node_num)
+	{
+		node_ids[0] = 0;
+		node_cpus[0] = 0;
+		node_num = 1;
+	}
+
+	return node_num;
+}
+
+typedef struct {
+	int fds[TEST_NUMA_BUFFER_NUM];
+	int fd_num;
+	uint64_t node_bytes[TEST_MAX_NUMA_NODES];
+	uint64_t other_node_bytes;
+	uint64_t zone_bytes[TEST_MAX_ZONES];
+	char zone_name[TEST_MAX_ZONES][TEST_ZONE_NAME_LEN];
+	double mb_per_s;
+} test_numa_buffers;
+
+/* allocate the buffers from CPA and account where their pages come from. */
+static void test_numa_alloc_worker(void *data)
+{
+	test_numa_buffers *buffers = (test_numa_buffers *)data;
+	test_verify_args args;
+	int i, j;
+
+	for (i = 0; i < TEST_NUMA_BUFFER_NUM; i++)
+	{
+		int fd = test_allocate_from_CPA(TEST_NUMA_BUFFER_SIZE, TEST_NUMA_BUFFER_FLAGS);
+
+		if (fd <= 0)
+		{
+			continue;
+		}
+
+		buffers->fds[buffers->fd_num++] = fd;
+
+		memset(&args, 0, sizeof(args));
+		test_verify_allocated_buffer(fd, TEST_NUMA_BUFFER_SIZE, args);
+
+		for (j = 0; j < TEST_MAX_NUMA_NODES; j++)
+		{
+			buffers->node_bytes[j] += args.node_bytes[j];
+		}
+		buffers->other_node_bytes += args.other_node_bytes;
+
+		for (j = 0; j < TEST_MAX_ZONES; j++)
+		{
+			buffers->zone_bytes[j] += args.zone_bytes[j];
+			if ('\0' != args.zone_name[j][0])
+			{
+				memcpy(buffers->zone_name[j], args.zone_name[j], TEST_ZONE_NAME_LEN);
+				buffers->zone_name[j][TEST_ZONE_NAME_LEN - 1] = '\0';
+			}
+		}
+	}
+}
+
+/* write then read every buffer, from the CPU the thread is pinned to. */
+static void test_numa_bandwidth_worker(void *data)
+{
+	test_numa_buffers *buffers = (test_numa_buffers *)data;
+	uint64_t bytes = 0, elapsed_ns = 0, sum = 0;
+	int i, round;
+
+	buffers->mb_per_s = 0;
+
+	for (i = 0; i < buffers->fd_num; i++)
+	{
+		void *addr = mmap(NULL, TEST_NUMA_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, buffers->fds[i], 0);
+		uint64_t start_ns;
+
+		if (MAP_FAILED == addr)
+		{
+			AERR("mmap of %d bytes failed: %s", TEST_NUMA_BUFFER_SIZE, strerror(errno));
+			continue;
+		}
+
+		/* fault the mapping in before timing. */
+		memset(addr, 0, TEST_NUMA_BUFFER_SIZE);
+
+		start_ns = test_get_time_ns();
+		for (round = 0; round < TEST_NUMA_BANDWIDTH_ROUNDS; round++)
+		{
+			volatile uint64_t *words = (volatile uint64_t *)addr;
+			size_t j;
+
+			memset(addr, round, TEST_NUMA_BUFFER_SIZE);
+			for (j = 0; j < TEST_NUMA_BUFFER_SIZE / sizeof(uint64_t); j++)
+			{
+				sum += words[j];
+			}
+		}
+		elapsed_ns += test_get_time_ns() - start_ns;
+		bytes += 2ULL * TEST_NUMA_BANDWIDTH_ROUNDS * TEST_NUMA_BUFFER_SIZE;
+
+		munmap(addr, TEST_NUMA_BUFFER_SIZE);
+	}
+
+	TEST_IGNORE(sum);
+
+	if (elapsed_ns > 0)
+	{
+		buffers->mb_per_s = (double)bytes / (1024.0 * 1024.0) / (elapsed_ns / 1000000000.0);
+	}
+}
+
+/*
+ * For each NUMA node, allocate CPA buffers from a thread pinned to one of
+ * its CPUs and report the share of bytes backed by that node, the zones
+ * used, and the read/write bandwidth seen from every node. Runs with
+ * fake-NUMA (numa=fake=N) as well as on real multi-node systems.
+ */
+void test_numa_locality()
+{
+	int node_ids[TEST_MAX_NUMA_NODES], node_cpus[TEST_MAX_NUMA_NODES];
+	int skipped, node_num = test_get_numa_nodes(node_ids, node_cpus, skipped);
+	test_numa_buffers buffers;
+	uint64_t total, local_total = 0, all_total = 0;
+	int i, j;
+
+	printf("    >>> %d NUMA node(s) with CPUs, %d x %d MB CPA buffers per node.\n",
+			node_num, TEST_NUMA_BUFFER_NUM, TEST_NUMA_BUFFER_SIZE>>20);
+
+	if (skipped > 0)
+	{
+		printf("    >>> %d more node(s) with CPUs have an id of %d or more and are not allocated from.\n",
+				skipped, TEST_MAX_NUMA_NODES);
+	}
+
+	for (i = 0; i < node_num; i++)
+	{
+		memset(&buffers, 0, sizeof(buffers));
+
+		if (!test_run_pinned(node_cpus[i], test_numa_alloc_worker, &buffers))
+		{
+			continue;
+		}
+
+		total = buffers.other_node_bytes;
+		for (j = 0; j < TEST_MAX_NUMA_NODES; j++)
+		{
+			total += buffers.node_bytes[j];
+		}
+
+		printf("\n    >>> Allocate on node %d (CPU %d): %d buffers, %.1f%% local.\n", node_ids[i], node_cpus[i],
+				buffers.fd_num, total > 0 ? 100.0 * buffers.node_bytes[node_ids[i]] / total : 0.0);
+
+		for (j = 0; j < TEST_MAX_NUMA_NODES; j++)
+		{
+			if (0 != buffers.node_bytes[j])
+			{
+				printf("        node %d: %" PRIu64 " MB\n", j, buffers.node_bytes[j]>>20);
+			}
+		}
+
+		if (0 != buffers.other_node_bytes)
+		{
+			printf("        nodes >= %d: %" PRIu64 " MB\n", TEST_MAX_NUMA_NODES, buffers.other_node_bytes>>20);
+		}
+
+		for (j = 0; j < TEST_MAX_ZONES; j++)
+		{
+			if (0 != buffers.zone_bytes[j])
+			{
+				printf("        zone %s: %" PRIu64 " MB\n", buffers.zone_name[j], buffers.zone_bytes[j]>>20);
+			}
+		}
+
+		for (j = 0; j < node_num; j++)
+		{
+			test_run_pinned(node_cpus[j], test_numa_bandwidth_worker, &buffers);
+			printf("        %s bandwidth from node %d: %.0f MB/s\n", TEST_NUMA_BUFFER_MAPPING,
+					node_ids[j], buffers.mb_per_s);
+		}
+
+		local_total += buffers.node_bytes[node_ids[i]];
+		all_total += total;
+
+		for (j = 0; j < buffers.fd_num; j++)
+		{
+			test_free_CPA_mem(buffers.fds[j]);
+		}
+	}
+
+	printf("\n    >>> Overall locality: %.1f%% of CPA bytes on the allocating node.\n",
+			all_total > 0 ? 100.0 * local_total / all_total : 0.0);
+}
+
+#define TEST_CPA_DEBUGFS_PATH "/sys/kernel/debug/ion/heaps/compound_page"
+#define TEST_CPA_DEBUGFS_PATH_OLD "/sys/kernel/debug/ion/heaps/ion_compound_page"
+#define TEST_BUDDYINFO_PATH "/proc/buddyinfo"
+#define TEST_MAX_PAGE_ORDERS 16
+
+typedef struct {
+	long long pool_pages;		/* -1 if CPA statistics are not available. */
+	long long live_bytes;		/* -1 if CPA statistics are not available. */
+	long long free_blocks[TEST_MAX_PAGE_ORDERS];
+	int orders;
+} test_memory_state;
+
+static char *test_read_text_file(const char *path, char *buf, size_t size)
+{
+	int fd = open(path, O_RDONLY);
+	ssize_t len, total = 0;
+
+	if (fd < 0)
+	{
+		return NULL;
+	}
+
+	while (total < (ssize_t)size - 1 && (len = read(fd, buf + total, size - 1 - total)) > 0)
+	{
+		total += len;
+	}
+	close(fd);
+
+	buf[total] = '\0';
+
+	return buf;
+}
+
+/*
+ * Read CPA pool depth and live bytes from its debugfs statistics
+ * (CONFIG_ION_COMPOUND_PAGE_STATS) and the free blocks of each order,
+ * summed over all zones, from /proc/buddyinfo.
+ */
+void test_get_memory_state(test_memory_state &state)
+{
+	static char buf[64 * 1024];
+	char *line, *pos;
+	int order;
+
+	state.pool_pages = -1;
+	state.live_bytes = -1;
+	state.orders = 0;
+	memset(state.free_blocks, 0, sizeof(state.free_blocks));
+
+	if (NULL != test_read_text_file(TEST_CPA_DEBUGFS_PATH, buf, sizeof(buf)) ||
+		NULL != test_read_text_file(TEST_CPA_DEBUGFS_PATH_OLD, buf, sizeof(buf)))
+	{
+		if (NULL != (pos = strstr(buf, " page(s) in pool")))
+		{
+			while (pos > buf && pos[-1] >= '0' && pos[-1] <= '9')
+			{
+				pos--;
+			}
+			state.pool_pages = atoll(pos);
+		}
+
+		/* the first entry is the total over all allocation sizes. */
+		if (NULL != (pos = strstr(buf, "Live bytes committed:")) &&
+			NULL != (pos = strchr(pos, '(')))
+		{
+			state.live_bytes = atoll(pos + 1);
+		}
+	}
+
+	if (NULL == test_read_text_file(TEST_BUDDYINFO_PATH, buf, sizeof(buf)))
+	{
+		return;
+	}
+
+	/* "Node 0, zone   Normal      1      2 ..." */
+	for (line = strtok_r(buf, "\n", &pos); NULL != line; line = strtok_r(NULL, "\n", &pos))
+	{
+		char *counts = strstr(line, "zone");
+		char *end;
+
+		if (NULL == counts)
+		{
+			continue;
+		}
+
+		counts += strlen("zone");
+		while (' ' == *counts)
+		{
+			counts++;
+		}
+		while ('\0' != *counts && ' ' != *counts)
+		{
+			counts++;
+		}
+
+		for (order = 0; order < TEST_MAX_PAGE_ORDERS; order++)
+		{
+			long long count = strtoll(counts, &end, 10);
+
+			if (end == counts)
+			{
+				break;
+			}
+
+			state.free_blocks[order] += count;
+			counts = end;
+		}
+
+		if (order > state.orders)
+		{
+			state.orders = order;
+		}
+	}
+}
+
+#define TEST_SOAK_MAX_LIVE 32
+#define TEST_SOAK_MAX_HOLD_MS 2000
+#define TEST_SOAK_MAX_IDLE_US 10000
+#define TEST_SOAK_PAGE_ORDER 9
+#define TEST_SOAK_SIZE_NUM 6
+/* flag a trend that changes a metric by this fraction over the run. */
+#define TEST_SOAK_DRIFT_THRESHOLD 0.5
+
+static size_t soak_size_arr[TEST_SOAK_SIZE_NUM] = {64*1024, 1024*1024, 2*1024*1024, 2*1024*1024+4*1024,
+		4*1024*1024, 8*1024*1024};
+
+typedef struct {
+	int fd;
+	int size;
+	uint64_t expire_ns;
+	bool verified;
+} test_soak_buffer;
+
+/*
+ * Running least squares sums of one metric over the checkpoints, x being
+ * the checkpoint index, so runs of any length are fitted in full.
+ */
+typedef struct {
+	double num;
+	double sum_x;
+	double sum_y;
+	double sum_xy;
+	double sum_xx;
+} test_trend;
+
+static void test_trend_add(test_trend &trend, double value)
+{
+	double x = trend.num;
+
+	trend.num++;
+	trend.sum_x += x;
+	trend.sum_y += value;
+	trend.sum_xy += x * value;
+	trend.sum_xx += x * x;
+}
+
+/* change of the least squares line over the run, relative to the mean. */
+static double test_relative_trend(const test_trend &trend)
+{
+	double num = trend.num;
+	double cov = num * trend.sum_xy - trend.sum_x * trend.sum_y;
+	double var = num * trend.sum_xx - trend.sum_x * trend.sum_x;
+	double mean_y = num > 0 ? trend.sum_y / num : 0;
+
+	if (0 == var || 0 == mean_y)
+	{
+		return 0;
+	}
+
+	return cov / var * (num - 1) / mean_y;
+}
+
+static void test_soak_free_buffer(test_soak_buffer *live, int &live_num, int index, long long &live_bytes)
+{
+	live_bytes -= live[index].size;
+	test_free_CPA_mem(live[index].fd);
+	live[index] = live[--live_num];
+}
+
+/*
+ * Verify the live buffers not verified yet in one parallel batch. Used
+ * with -p, where buffers are not verified one by one as they are
+ * allocated, before any of them is freed.
+ */
+static int test_soak_verify_live(test_soak_buffer *live, int live_num)
+{
+	int fds[TEST_SOAK_MAX_LIVE], sizes[TEST_SOAK_MAX_LIVE], index[TEST_SOAK_MAX_LIVE];
+	bool results[TEST_SOAK_MAX_LIVE];
+	int i, num = 0, thread_num;
+
+	for (i = 0; i < live_num; i++)
+	{
+		if (!live[i].verified)
+		{
+			index[num] = i;
+			fds[num] = live[i].fd;
+			sizes[num] = live[i].size;
+			num++;
+		}
+	}
+
+	if (0 == num)
+	{
+		return 0;
+	}
+
+	for (i = 0; i < num; i++)
+	{
+		live[index[i]].verified = true;
+	}
+
+	return test_verify_allocated_buffers_parallel(fds, num, 0, results, thread_num, sizes);
+}
+
+/* with -p, true when a buffer about to be freed has not been verified. */
+static bool test_soak_verify_due(const test_soak_buffer *live, int live_num, uint64_t now_ns)
+{
+	int i;
+
+	for (i = 0; i < live_num; i++)
+	{
+		if (!live[i].verified && (live_num == TEST_SOAK_MAX_LIVE || live[i].expire_ns <= now_ns))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Randomised alloc/hold/free workload on CPA for duration_s seconds. At
+ * every checkpoint the CPA success rate, allocation latency percentiles,
+ * pool depth, live bytes and free blocks per order are printed. At the
+ * end, trends in latency, order-9 availability and CPA live bytes not
+ * accounted to this test are reported as drift.
+ */
+void test_soak(int duration_s, int interval_s)
+{
+	test_soak_buffer live[TEST_SOAK_MAX_LIVE];
+	int live_num = 0, checkpoint_num = 0;
+	long long live_bytes = 0, baseline_live_bytes;
+	int attempts = 0, successes = 0, verify_failed = 0;
+	test_histogram interval_latency;
+	test_memory_state state;
+	unsigned int seed = (unsigned int)time(NULL);
+	uint64_t now_ns, start_ns, end_ns, next_checkpoint_ns;
+	test_trend p99_trend, order_trend;
+	long long first_leaked_bytes = 0, leaked_bytes = 0;
+	double trend;
+	int i, order;
+
+	memset(&p99_trend, 0, sizeof(p99_trend));
+	memset(&order_trend, 0, sizeof(order_trend));
+
+	test_get_memory_state(state);
+	baseline_live_bytes = state.live_bytes;
+
+	printf("    >>> Soak for %d s, checkpoint every %d s, random seed %u.\n", duration_s, interval_s, seed);
+	if (state.live_bytes < 0)
+	{
+		printf("    >>> CPA debugfs statistics not available, pool depth and leaks are not tracked.\n");
+	}
+
+	test_histogram_init(&interval_latency, "cpa alloc");
+
+	start_ns = test_get_time_ns();
+	end_ns = start_ns + (uint64_t)duration_s * 1000000000ULL;
+	next_checkpoint_ns = start_ns + (uint64_t)interval_s * 1000000000ULL;
+
+	while ((now_ns = test_get_time_ns()) < end_ns)
+	{
+		if (parallel_verify && test_soak_verify_due(live, live_num, now_ns))
+		{
+			verify_failed += test_soak_verify_live(live, live_num);
+		}
+
+		/* release buffers whose hold time is over. */
+		for (i = live_num - 1; i >= 0; i--)
+		{
+			if (live[i].expire_ns <= now_ns)
+			{
+				test_soak_free_buffer(live, live_num, i, live_bytes);
+			}
+		}
+
+		if (live_num == TEST_SOAK_MAX_LIVE)
+		{
+			test_soak_free_buffer(live, live_num, rand_r(&seed) % live_num, live_bytes);
+		}
+
+		{
+			int size = soak_size_arr[rand_r(&seed) % TEST_SOAK_SIZE_NUM];
+			uint64_t alloc_start_ns = test_get_time_ns();
+			int fd = test_allocate_from_CPA(size);
+
+			test_histogram_record(&interval_latency, test_get_time_ns() - alloc_start_ns);
+			attempts++;
+
+			if (fd > 0)
+			{
+				successes++;
+
+				if (!parallel_verify && !test_verify_allocated_buffer(fd, size))
+				{
+					verify_failed++;
+				}
+
+				live[live_num].fd = fd;
+				live[live_num].size = size;
+				live[live_num].expire_ns = test_get_time_ns() +
+						(uint64_t)(rand_r(&seed) % TEST_SOAK_MAX_HOLD_MS) * 1000000ULL;
+				live[live_num].verified = !parallel_verify;
+				live_num++;
+				live_bytes += size;
+			}
+		}
+
+		usleep(rand_r(&seed) % TEST_SOAK_MAX_IDLE_US);
 
-int test_initialize()
-{
-	ion_client = ion_open();
+		if (test_get_time_ns() < next_checkpoint_ns)
+		{
+			continue;
+		}
 
-	if (ion_client < 0)
-	{
-		AERR("ion_open failed.");
-		return -1;
-	}
+		next_checkpoint_ns += (uint64_t)interval_s * 1000000000ULL;
 
-	test_handle = open(TEST_DEV_PATH, O_RDWR);
+		test_get_memory_state(state);
 
-	if (test_handle < 0)
-	{
-		AERR("Open test device failed.");
+		printf("        [%6" PRIu64 " s] success %5.1f%% (%d/%d), verify failed %d, pool %lld pages, live CPA %lld MB (test %lld MB)\n",
+				(test_get_time_ns() - start_ns) / 1000000000,
+				attempts > 0 ? 100.0 * successes / attempts : 0.0, successes, attempts, verify_failed,
+				state.pool_pages, state.live_bytes >= 0 ? state.live_bytes>>20 : -1, live_bytes>>20);
+		test_histogram_print(&interval_latency);
+		printf("        free blocks per order:");
+		for (order = 0; order < state.orders; order++)
+		{
+			printf(" %lld", state.free_blocks[order]);
+		}
+		printf("\n");
 
-		if (0 != ion_close(ion_client))
+		test_trend_add(p99_trend, test_histogram_percentile(&interval_latency, 99) / 1000.0);
+		test_trend_add(order_trend, state.free_blocks[TEST_SOAK_PAGE_ORDER]);
+
+		/* CPA live bytes not held by this test. */
+		leaked_bytes = baseline_live_bytes >= 0 && state.live_bytes >= 0 ?
+				state.live_bytes - live_bytes - baseline_live_bytes : 0;
+		if (0 == checkpoint_num)
 		{
-			AERR("Close ion_client failed in test_initialize.");
+			first_leaked_bytes = leaked_bytes;
 		}
+		checkpoint_num++;
 
-		return -1;
+		attempts = 0;
+		successes = 0;
+		test_histogram_init(&interval_latency, "cpa alloc");
 	}
 
-	return 0;
-}
-
-int test_uninitialize()
-{
-	if (0 != ion_close(ion_client))
+	if (parallel_verify)
 	{
-		AERR("Failed to close ion_client");
+		verify_failed += test_soak_verify_live(live, live_num);
 	}
-	if (0 != close(test_handle))
+
+	while (live_num > 0)
 	{
-		AERR("Failed to close test_handle");
+		test_soak_free_buffer(live, live_num, live_num - 1, live_bytes);
 	}
 
-	return 0;
-}
-
-int test_allocate_from_CPA(size_t size)
-{
-	ion_user_handle_t ion_hnd = -1;
-	int shared_fd, ret;
+	printf("\n    >>> Drift over %d checkpoints:\n", checkpoint_num);
 
-	if (size <=0)
+	if (checkpoint_num < 3)
 	{
-		return -1;
+		printf("        not enough checkpoints to detect drift.\n");
+		return;
 	}
 
-#if defined(ION_HEAP_TYPE_COMPOUND_PAGE_MASK)
-	ret = ion_alloc(ion_client, size, 0, ION_HEAP_TYPE_COMPOUND_PAGE_MASK, 0, &ion_hnd);
-#else
-	ret = -1;
-#endif
+	trend = test_relative_trend(p99_trend);
+	printf("        p99 allocation latency: %+.1f%% %s\n", 100.0 * trend,
+			trend > TEST_SOAK_DRIFT_THRESHOLD ? "<<< DRIFT: latency keeps rising" : "");
 
-	if (ret < 0)
-	{
-		AERR("ion_alloc failed");
-		return -1;
-	}
+	trend = test_relative_trend(order_trend);
+	printf("        free order-%d blocks: %+.1f%% %s\n", TEST_SOAK_PAGE_ORDER, 100.0 * trend,
+			trend < -TEST_SOAK_DRIFT_THRESHOLD ? "<<< DRIFT: large pages keep disappearing" : "");
 
-	ret = ion_share(ion_client, ion_hnd, &shared_fd );
-	if (0 != ret)
+	if (baseline_live_bytes >= 0)
 	{
-		AERR("ion_share failed");
-		shared_fd = -1;
+		test_get_memory_state(state);
+		printf("        CPA live bytes not held by the test: %lld KB at first checkpoint, %lld KB at last, %lld KB after freeing all %s\n",
+				first_leaked_bytes>>10, leaked_bytes>>10,
+				(state.live_bytes - baseline_live_bytes)>>10,
+				state.live_bytes > baseline_live_bytes ? "<<< DRIFT: live bytes leaked" : "");
 	}
+}
 
-	ret = ion_free(ion_client, ion_hnd);
-	if (0 != ret)
+#define TEST_SWAPCHAIN_BUFFER_SIZE (1920*1080*4)
+#define TEST_SWAPCHAIN_MAX_DEPTH 4
+#define TEST_SWAPCHAIN_DISPLAY_BUFFERS 3
+/* vsyncs the consumer waits for a pre-allocated buffer before dropping the frame. */
+#define TEST_SWAPCHAIN_WAIT_VSYNCS 4
+
+/*
+ * Buffers the producer pre-allocated ahead of the consumer. The producer
+ * keeps up to depth buffers queued, the consumer takes one per vsync.
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int queue[TEST_SWAPCHAIN_MAX_DEPTH];
+	int head;
+	int count;
+	int depth;
+	bool stop;
+	int alloc_failed;
+	test_latency_stats stats;
+} test_swapchain;
+
+static void *test_swapchain_producer(void *data)
+{
+	test_swapchain *chain = (test_swapchain *)data;
+	int fd;
+
+	thread_latency_stats = &chain->stats;
+
+	pthread_mutex_lock(&chain->lock);
+	while (!chain->stop)
 	{
-		AERR("ion_free failed");
+		if (chain->count >= chain->depth)
+		{
+			pthread_cond_wait(&chain->cond, &chain->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&chain->lock);
 
-		if (-1 != shared_fd && 0 != close(shared_fd))
+		fd = test_allocate_from_CPA(TEST_SWAPCHAIN_BUFFER_SIZE);
+
+		pthread_mutex_lock(&chain->lock);
+		if (fd <= 0)
 		{
-			AERR("Close shared_fd failed in test_allocate_from_CPA.");
+			chain->alloc_failed++;
+			pthread_mutex_unlock(&chain->lock);
+			usleep(1000);
+			pthread_mutex_lock(&chain->lock);
+			continue;
 		}
 
-		return -1;
+		chain->queue[(chain->head + chain->count) % TEST_SWAPCHAIN_MAX_DEPTH] = fd;
+		chain->count++;
+		pthread_cond_broadcast(&chain->cond);
 	}
+	pthread_mutex_unlock(&chain->lock);
 
-	return shared_fd;
+	thread_latency_stats = NULL;
+
+	return NULL;
 }
 
-void test_free_CPA_mem(int fd)
+/*
+ * Take the next pre-allocated buffer, waiting for the producer up to
+ * timeout_ns. Returns -1 if no buffer arrived in time.
+ */
+static int test_swapchain_acquire(test_swapchain *chain, uint64_t timeout_ns, int &queued)
 {
-	if (fd <= 0)
+	struct timespec deadline;
+	uint64_t deadline_ns = test_get_time_ns() + timeout_ns;
+	int fd = -1;
+
+	deadline.tv_sec = deadline_ns / 1000000000ULL;
+	deadline.tv_nsec = deadline_ns % 1000000000ULL;
+
+	pthread_mutex_lock(&chain->lock);
+	queued = chain->count;
+	while (0 == chain->count)
 	{
-		return;
+		if (ETIMEDOUT == pthread_cond_timedwait(&chain->cond, &chain->lock, &deadline))
+		{
+			break;
+		}
 	}
 
-	if (0 != close(fd))
+	if (chain->count > 0)
 	{
-		AERR("Close fd failed in test_free_CPA_mem.");
+		fd = chain->queue[chain->head];
+		chain->head = (chain->head + 1) % TEST_SWAPCHAIN_MAX_DEPTH;
+		chain->count--;
+		pthread_cond_broadcast(&chain->cond);
 	}
+	pthread_mutex_unlock(&chain->lock);
+
+	return fd;
 }
 
-bool test_verify_allocated_buffer(int shared_fd, int mem_size)
+typedef struct {
+	int frames;
+	int missed;
+	int dropped;
+	int alloc_failed;
+	uint64_t queued_total;
+	test_histogram acquire;
+} test_swapchain_result;
+
+/*
+ * Run frames vsyncs at fps. With depth 0 the consumer allocates each
+ * buffer itself, otherwise a producer thread keeps depth buffers
+ * pre-allocated. A frame misses its deadline when getting its buffer takes
+ * longer than one vsync period. The consumer keeps the last
+ * TEST_SWAPCHAIN_DISPLAY_BUFFERS buffers on "display" and frees the oldest.
+ */
+void test_swapchain_run(int fps, int frames, int depth, test_swapchain_result &result)
 {
-	test_verify_args args;
+	uint64_t period_ns = 1000000000ULL / fps;
+	uint64_t next_vsync_ns, vsync_ns, acquire_ns;
+	int displayed[TEST_SWAPCHAIN_DISPLAY_BUFFERS];
+	test_swapchain *chain = NULL;
+	pthread_condattr_t cond_attr;
+	pthread_t producer;
+	struct timespec ts;
+	int i, fd, queued;
+
+	memset(&result, 0, sizeof(result));
+	test_histogram_init(&result.acquire, "acquire");
+	result.frames = frames;
+
+	for (i = 0; i < TEST_SWAPCHAIN_DISPLAY_BUFFERS; i++)
+	{
+		displayed[i] = -1;
+	}
 
-	if (shared_fd <= 0)
+	if (depth > 0)
 	{
-		AERR("Invalid shared fd.");
-		return false;
+		chain = (test_swapchain *)malloc(sizeof(test_swapchain));
+		if (NULL == chain)
+		{
+			AERR("Failed to allocate swapchain.");
+			return;
+		}
+
+		pthread_mutex_init(&chain->lock, NULL);
+		pthread_condattr_init(&cond_attr);
+		pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&chain->cond, &cond_attr);
+		pthread_condattr_destroy(&cond_attr);
+		chain->head = 0;
+		chain->count = 0;
+		chain->depth = depth;
+		chain->stop = false;
+		chain->alloc_failed = 0;
+		test_latency_stats_init(&chain->stats);
+
+		if (0 != pthread_create(&producer, NULL, test_swapchain_producer, chain))
+		{
+			AERR("pthread_create failed for swapchain producer.");
+			pthread_cond_destroy(&chain->cond);
+			pthread_mutex_destroy(&chain->lock);
+			free(chain);
+			return;
+		}
 	}
 
-	args.shared_fd = shared_fd;
-	args.mem_size = mem_size;
+	next_vsync_ns = test_get_time_ns() + period_ns;
 
-	if (0 != ioctl(test_handle, TEST_IOCTL_VERIFY_CPA, &args))
+	for (i = 0; i < frames; i++)
 	{
-		AERR("ioctl: test verify failed.");
-		return false;
-	}
+		ts.tv_sec = next_vsync_ns / 1000000000ULL;
+		ts.tv_nsec = next_vsync_ns % 1000000000ULL;
+		while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+		{
+		}
 
-	return (bool)args.verify_result;
-}
+		vsync_ns = test_get_time_ns();
 
-bool test_start_simulate_memory_fragment(int &free_pages, int &allocated_pages, int &simulate_page_unit_size)
-{
-	test_simulate_args args;
+		if (NULL != chain)
+		{
+			fd = test_swapchain_acquire(chain, TEST_SWAPCHAIN_WAIT_VSYNCS * period_ns, queued);
+			result.queued_total += queued;
+		}
+		else
+		{
+			fd = test_allocate_from_CPA(TEST_SWAPCHAIN_BUFFER_SIZE);
+			if (fd <= 0)
+			{
+				result.alloc_failed++;
+			}
+		}
 
-	if (0 != ioctl(test_handle, TEST_IOCTL_START_SIMULATE_FRAGMENT, &args))
-	{
-		AERR("ioctl: test start simulate failed.");
-		return false;
-	}
+		acquire_ns = test_get_time_ns() - vsync_ns;
+		test_histogram_record(&result.acquire, acquire_ns);
 
-	free_pages = args.system_free_pages;
-	allocated_pages = args.test_allocated_page;
-	simulate_page_unit_size = args.simulate_page_unit_size;
+		if (acquire_ns > period_ns)
+		{
+			result.missed++;
+		}
 
-	return args.simulate_result;
-}
+		if (fd <= 0)
+		{
+			result.dropped++;
+		}
+		else
+		{
+			test_free_CPA_mem(displayed[i % TEST_SWAPCHAIN_DISPLAY_BUFFERS]);
+			displayed[i % TEST_SWAPCHAIN_DISPLAY_BUFFERS] = fd;
+		}
 
-bool test_free_one_simulate_page_unit(int &free_pages, int &allocated_pages)
-{
-	test_simulate_args args;
+		/* a late frame pushes the next one to the following vsync. */
+		next_vsync_ns += period_ns;
+		while (next_vsync_ns <= test_get_time_ns())
+		{
+			next_vsync_ns += period_ns;
+		}
+	}
 
-	if (0 != ioctl(test_handle, TEST_IOCTL_FREE_ONE_PAGE_UNIT, &args))
+	if (NULL != chain)
 	{
-		AERR("ioctl: test free simulate failed.");
-		return false;
-	}
+		pthread_mutex_lock(&chain->lock);
+		chain->stop = true;
+		pthread_cond_broadcast(&chain->cond);
+		pthread_mutex_unlock(&chain->lock);
 
-	free_pages = args.system_free_pages;
-	allocated_pages = args.test_allocated_page;
+		pthread_join(producer, NULL);
+		test_latency_stats_merge(&latency_stats, &chain->stats);
 
-	return args.simulate_result;
+		while (chain->count > 0)
+		{
+			test_free_CPA_mem(chain->queue[chain->head]);
+			chain->head = (chain->head + 1) % TEST_SWAPCHAIN_MAX_DEPTH;
+			chain->count--;
+		}
+
+		result.alloc_failed = chain->alloc_failed;
+
+		pthread_cond_destroy(&chain->cond);
+		pthread_mutex_destroy(&chain->lock);
+		free(chain);
+	}
+
+	for (i = 0; i < TEST_SWAPCHAIN_DISPLAY_BUFFERS; i++)
+	{
+		test_free_CPA_mem(displayed[i]);
+	}
 }
 
-bool test_stop_simulate_memory_fragment()
+/* sweep the pre-allocation depth and return the smallest without misses. */
+static int test_swapchain_sweep(int fps, int frames)
 {
-	test_simulate_args args;
+	test_swapchain_result result;
+	int depth, needed_depth = -1;
 
-	if (0 != ioctl(test_handle, TEST_IOCTL_STOP_SIMULATE_FRAGMENT, &args))
+	printf("        %5s  %6s  %6s  %7s  %6s  %10s  %10s  %10s\n",
+			"depth", "missed", "drops", "failed", "queued", "p50(us)", "p99(us)", "max(us)");
+
+	for (depth = 0; depth <= TEST_SWAPCHAIN_MAX_DEPTH; depth++)
 	{
-		AERR("ioctl: test stop simulate failed.");
-		return false;
+		test_swapchain_run(fps, frames, depth, result);
+
+		printf("        %5d  %6d  %6d  %7d  %6.2f  %10.1f  %10.1f  %10.1f\n",
+				depth, result.missed, result.dropped, result.alloc_failed,
+				(double)result.queued_total / result.frames,
+				test_histogram_percentile(&result.acquire, 50) / 1000.0,
+				test_histogram_percentile(&result.acquire, 99) / 1000.0,
+				result.acquire.max / 1000.0);
+
+		if (dump_histograms)
+		{
+			test_histogram_dump(&result.acquire);
+		}
+
+		if (needed_depth < 0 && 0 == result.missed && 0 == result.dropped)
+		{
+			needed_depth = depth;
+		}
 	}
 
-	return args.simulate_result;
+	return needed_depth;
 }
 
+/*
+ * Simulate a producer/consumer swapchain at fps, with buffers allocated
+ * from CPA, on the idle system and under the simulated memory
+ * fragmentation. Reports, per pre-allocation depth, the frames whose
+ * buffer was not ready within one vsync period.
+ */
+void test_swapchain_simulation(int fps, int frames)
+{
+	int system_free_pages, test_allocated_pages, simulate_page_unit_size;
+	int idle_depth, fragment_depth;
 
-#define TEST_ALLOC_NUM 5
-#define TEST_ALLOC_FAIL_TIMES 200
-#define TEST_ALLOC_DEFAULT_SIZE 2*1024*1024
-#define TEST_IGNORE(x) (void)x
+	printf("    >>> %d frames at %d fps (%.1f ms per frame), %d KB buffers, %d buffers on display.\n",
+			frames, fps, 1000.0 / fps, TEST_SWAPCHAIN_BUFFER_SIZE>>10, TEST_SWAPCHAIN_DISPLAY_BUFFERS);
 
-/* pre-defined memory size we want to test. */
-static size_t mem_size_arr[TEST_ALLOC_NUM] = {1024, 1024*1024, 2*1024*1024, 2*1024*1014+3*1024, 64*1024*1024};
+	printf("\n    >>> Idle system:\n");
+	idle_depth = test_swapchain_sweep(fps, frames);
+
+	test_start_simulate_memory_fragment(system_free_pages, test_allocated_pages, simulate_page_unit_size);
+	printf("\n    >>> After simulate memory fragment, system free memory: %d MB, test allocated memory: %d MB.\n",
+			system_free_pages>>8, test_allocated_pages>>8);
+	fragment_depth = test_swapchain_sweep(fps, frames);
+	test_stop_simulate_memory_fragment();
+
+	printf("\n    >>> Pre-allocation depth needed for no missed frame: idle %d, fragmented %d (-1: none up to %d).\n",
+			idle_depth, fragment_depth, TEST_SWAPCHAIN_MAX_DEPTH);
+}
+
+static void test_usage(const char *name)
+{
+	printf("Usage: %s [-p] [-m] [-f interval,probability[,delay_us]] [-k order] [-d] [-N] [-s seconds[,interval]] [-w fps[,frames]] [-H] [-h]\n", name);
+	printf("  -p  verify allocated buffers in parallel, one worker per CPU\n");
+	printf("  -m  run the mmap and page fault cost benchmark\n");
+	printf("  -f  inject page allocation faults, every interval-th allocation fails\n");
+	printf("      with probability percent, each allocation is delayed by delay_us\n");
+	printf("      probability 0 with a delay_us only delays the test module allocations\n");
+	printf("  -k  time alloc_pages() at the given order in the test module\n");
+	printf("  -d  run the dma-buf attach and map cost benchmark\n");
+	printf("  -N  report NUMA node and zone locality of CPA buffers\n");
+	printf("  -s  run a randomised soak on CPA, checkpoint every interval seconds\n");
+	printf("  -w  simulate a swapchain at fps with pipelined CPA pre-allocation\n");
+	printf("  -H  dump every latency histogram bucket at the end of the test\n");
+	printf("  -h  show this help\n");
+}
 
 int main(int argc, char** argv)
 {
 	int shared_fd;
-	int i;
-	int allocated_buffer_handle[8192];    //support 16GB maximum system memory
+	int i, opt;
+	int allocated_buffer_handle[TEST_MAX_BUFFER_NUM];
 	int allocated_buffer_num = 0;
 	int failed_times = 0;
 	int first_failed_times = 0, second_failed_times = 0;
 	int system_free_pages, test_allocated_pages, simulate_page_unit_size;
-
-	TEST_IGNORE(argc);
-	TEST_IGNORE(argv);
+	bool run_mmap_benchmark = false;
+	bool run_fault_injection = false;
+	int kbench_order = -1;
+	bool run_dma_map_benchmark = false;
+	bool run_numa_locality = false;
+	int soak_duration_s = 0, soak_interval_s = 60;
+	int swapchain_fps = 0, swapchain_frames = 300;
+	int fault_interval = 0, fault_probability = 0, fault_delay_us = 0;
+
+	test_latency_stats_init(&latency_stats);
+	test_latency_stats_init(&system_latency_stats);
+
+	while ((opt = getopt(argc, argv, "pmf:k:dNs:w:Hh")) != -1)
+	{
+		switch (opt)
+		{
+		case 'p':
+			parallel_verify = true;
+			break;
+		case 'm':
+			run_mmap_benchmark = true;
+			break;
+		case 'f':
+			if (sscanf(optarg, "%d,%d,%d", &fault_interval, &fault_probability, &fault_delay_us) < 2 ||
+				fault_interval < 0 || fault_probability < 0 || fault_probability > 100 || fault_delay_us < 0 ||
+				(0 == fault_probability && 0 == fault_delay_us))
+			{
+				test_usage(argv[0]);
+				return -1;
+			}
+			run_fault_injection = true;
+			break;
+		case 'k':
+			kbench_order = atoi(optarg);
+			if (kbench_order < 0)
+			{
+				test_usage(argv[0]);
+				return -1;
+			}
+			break;
+		case 'd':
+			run_dma_map_benchmark = true;
+			break;
+		case 'N':
+			run_numa_locality = true;
+			break;
+		case 's':
+			if (sscanf(optarg, "%d,%d", &soak_duration_s, &soak_interval_s) < 1 ||
+				soak_duration_s <= 0 || soak_interval_s <= 0)
+			{
+				test_usage(argv[0]);
+				return -1;
+			}
+			break;
+		case 'w':
+			if (sscanf(optarg, "%d,%d", &swapchain_fps, &swapchain_frames) < 1 ||
+				swapchain_fps <= 0 || swapchain_frames <= 0)
+			{
+				test_usage(argv[0]);
+				return -1;
+			}
+			break;
+		case 'H':
+			dump_histograms = true;
+			break;
+		case 'h':
+			test_usage(argv[0]);
+			return 0;
+		default:
+			test_usage(argv[0]);
+			return -1;
+		}
+	}
 
 	printf("CPA test start!!!\n");
 
@@ -273,7 +2264,7 @@ int main(int argc, char** argv)
 	 * 2MB until the system memory is exhausted.
 	 */
 	printf("%d. Try to allocate from CPA until system mem exhausts.\n", i+1);
-	while(1)
+	while (allocated_buffer_num < TEST_MAX_BUFFER_NUM)
 	{
 		int tmp_fd = test_allocate_from_CPA(TEST_ALLOC_DEFAULT_SIZE);
 
@@ -289,9 +2280,10 @@ int main(int argc, char** argv)
 			}
 		}
 
-		if (!test_verify_allocated_buffer(tmp_fd, TEST_ALLOC_DEFAULT_SIZE))
+		if (!parallel_verify && !test_verify_allocated_buffer(tmp_fd, TEST_ALLOC_DEFAULT_SIZE))
 		{
 			printf("    >>> Failed to verify CPA memory, stop allocating.\n");
+			test_free_CPA_mem(tmp_fd);
 			break;
 		}
 
@@ -299,6 +2291,17 @@ int main(int argc, char** argv)
 		allocated_buffer_num++;
 	}
 
+	if (parallel_verify && allocated_buffer_num > 0)
+	{
+		int thread_num;
+		uint64_t start_ns = test_get_time_ns();
+		int verify_failed = test_verify_allocated_buffers_parallel(allocated_buffer_handle,
+				allocated_buffer_num, TEST_ALLOC_DEFAULT_SIZE, verify_results, thread_num);
+
+		printf("    >>> Verified %d buffers on %d threads in %" PRIu64 " ms, %d failed.\n",
+				allocated_buffer_num, thread_num, (test_get_time_ns() - start_ns) / 1000000, verify_failed);
+	}
+
 	for (i = 0; i < allocated_buffer_num; i++)
 	{
 		test_free_CPA_mem(allocated_buffer_handle[i]);
@@ -398,6 +2401,85 @@ int main(int argc, char** argv)
 
 	printf("\n===================Test 2 END===================.\n");
 
+	if (run_mmap_benchmark)
+	{
+		printf("\n===================Test 3 START===================.\n");
+		printf("Compare mmap, first touch and munmap cost of CPA and system heap buffers.\n");
+
+		test_mmap_cost_benchmark();
+
+		printf("\n===================Test 3 END===================.\n");
+	}
+
+	if (run_fault_injection)
+	{
+		printf("\n===================Test 4 START===================.\n");
+		printf("Inject page allocation faults into CPA and the test-cpa module.\n");
+
+		test_fault_injection(fault_interval, fault_probability, fault_delay_us);
+
+		printf("\n===================Test 4 END===================.\n");
+	}
+
+	if (kbench_order >= 0)
+	{
+		printf("\n===================Test 5 START===================.\n");
+		printf("Measure order-%d page allocation latency in test-cpa module.\n", kbench_order);
+
+		test_kernel_alloc_benchmark(kbench_order);
+
+		printf("\n===================Test 5 END===================.\n");
+	}
+
+	if (run_dma_map_benchmark)
+	{
+		printf("\n===================Test 6 START===================.\n");
+		printf("Compare dma-buf attach and map cost of CPA and system heap buffers.\n");
+
+		test_dma_map_cost_benchmark();
+
+		printf("\n===================Test 6 END===================.\n");
+	}
+
+	if (run_numa_locality)
+	{
+		printf("\n===================Test 7 START===================.\n");
+		printf("Report NUMA node and zone locality of CPA buffers.\n");
+
+		test_numa_locality();
+
+		printf("\n===================Test 7 END===================.\n");
+	}
+
+	if (soak_duration_s > 0)
+	{
+		printf("\n===================Test 8 START===================.\n");
+		printf("Soak CPA with a randomised alloc/hold/free workload.\n");
+
+		test_soak(soak_duration_s, soak_interval_s);
+
+		printf("\n===================Test 8 END===================.\n");
+	}
+
+	if (swapchain_fps > 0)
+	{
+		printf("\n===================Test 9 START===================.\n");
+		printf("Simulate a swapchain with CPA buffers pre-allocated ahead of vsync.\n");
+
+		test_swapchain_simulation(swapchain_fps, swapchain_frames);
+
+		printf("\n===================Test 9 END===================.\n");
+	}
+
+	printf("\nLatency of timed CPA operations (us):\n");
+	test_latency_stats_print(&latency_stats, dump_histograms);
+
+	if (0 != system_latency_stats.alloc.total)
+	{
+		printf("\nLatency of timed system heap operations (us):\n");
+		test_latency_stats_print(&system_latency_stats, dump_histograms);
+	}
+
 	test_uninitialize();
 	printf("CPA test end!!!\n");
 
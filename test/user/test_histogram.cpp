@@ -0,0 +1,179 @@
+/*
+ * test_histogram.cpp
+ * Copyright (C) 2017 Arm Ltd.
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <string.h>
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "test_histogram.h"
+
+static int test_histogram_index(uint64_t value)
+{
+	int msb;
+
+	if (value < TEST_HIST_SUB_BUCKETS)
+	{
+		return (int)value;
+	}
+
+	msb = 63 - __builtin_clzll(value);
+
+	return (msb - TEST_HIST_SUB_BUCKET_BITS + 1) * TEST_HIST_SUB_BUCKETS +
+			(int)(value >> (msb - TEST_HIST_SUB_BUCKET_BITS)) - TEST_HIST_SUB_BUCKETS;
+}
+
+static uint64_t test_histogram_bucket_low(int index)
+{
+	int shift;
+
+	if (index < TEST_HIST_SUB_BUCKETS)
+	{
+		return index;
+	}
+
+	shift = index / TEST_HIST_SUB_BUCKETS - 1;
+
+	return (uint64_t)(TEST_HIST_SUB_BUCKETS + index % TEST_HIST_SUB_BUCKETS) << shift;
+}
+
+static uint64_t test_histogram_bucket_high(int index)
+{
+	int shift;
+
+	if (index < TEST_HIST_SUB_BUCKETS)
+	{
+		return index;
+	}
+
+	shift = index / TEST_HIST_SUB_BUCKETS - 1;
+
+	return test_histogram_bucket_low(index) + ((uint64_t)1 << shift) - 1;
+}
+
+void test_histogram_init(test_histogram *hist, const char *name)
+{
+	memset(hist, 0, sizeof(*hist));
+	hist->name = name;
+	hist->min = UINT64_MAX;
+}
+
+void test_histogram_record(test_histogram *hist, uint64_t value)
+{
+	hist->counts[test_histogram_index(value)]++;
+	hist->total++;
+	hist->sum += value;
+
+	if (value < hist->min)
+	{
+		hist->min = value;
+	}
+	if (value > hist->max)
+	{
+		hist->max = value;
+	}
+}
+
+void test_histogram_merge(test_histogram *dst, const test_histogram *src)
+{
+	int i;
+
+	for (i = 0; i < TEST_HIST_BUCKETS; i++)
+	{
+		dst->counts[i] += src->counts[i];
+	}
+
+	dst->total += src->total;
+	dst->sum += src->sum;
+
+	if (src->min < dst->min)
+	{
+		dst->min = src->min;
+	}
+	if (src->max > dst->max)
+	{
+		dst->max = src->max;
+	}
+}
+
+uint64_t test_histogram_percentile(const test_histogram *hist, double percentile)
+{
+	uint64_t target, seen = 0;
+	int i;
+
+	if (0 == hist->total)
+	{
+		return 0;
+	}
+
+	target = (uint64_t)(percentile / 100.0 * hist->total + 0.5);
+	if (target < 1)
+	{
+		target = 1;
+	}
+
+	for (i = 0; i < TEST_HIST_BUCKETS; i++)
+	{
+		seen += hist->counts[i];
+		if (seen >= target)
+		{
+			/* the real maximum is tighter than the bucket bound. */
+			uint64_t high = test_histogram_bucket_high(i);
+			return high < hist->max ? high : hist->max;
+		}
+	}
+
+	return hist->max;
+}
+
+void test_histogram_print(const test_histogram *hist)
+{
+	if (0 == hist->total)
+	{
+		printf("        %-10s  no samples\n", hist->name);
+		return;
+	}
+
+	printf("        %-10s  n=%-8" PRIu64 " min %9.1f  mean %9.1f  p50 %9.1f  p90 %9.1f  p99 %9.1f  p99.9 %9.1f  max %9.1f us\n",
+			hist->name, hist->total,
+			hist->min / 1000.0,
+			(double)hist->sum / hist->total / 1000.0,
+			test_histogram_percentile(hist, 50) / 1000.0,
+			test_histogram_percentile(hist, 90) / 1000.0,
+			test_histogram_percentile(hist, 99) / 1000.0,
+			test_histogram_percentile(hist, 99.9) / 1000.0,
+			hist->max / 1000.0);
+}
+
+void test_histogram_dump(const test_histogram *hist)
+{
+	int i;
+
+	printf("        %s buckets (ns): low high count\n", hist->name);
+
+	for (i = 0; i < TEST_HIST_BUCKETS; i++)
+	{
+		if (0 != hist->counts[i])
+		{
+			printf("        %s %" PRIu64 " %" PRIu64 " %" PRIu64 "\n", hist->name,
+					test_histogram_bucket_low(i), test_histogram_bucket_high(i), hist->counts[i]);
+		}
+	}
+}
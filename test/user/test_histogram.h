@@ -0,0 +1,61 @@
+/*
+ * test_histogram.h
+ * Copyright (C) 2017 Arm Ltd.
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef __TEST_HISTOGRAM_H__
+#define __TEST_HISTOGRAM_H__
+
+#include <stdint.h>
+
+/*
+ * Log-linear latency histogram in the style of HdrHistogram. Values below
+ * TEST_HIST_SUB_BUCKETS get one bucket each, every power of two above that
+ * is split into TEST_HIST_SUB_BUCKETS linear buckets, so the relative error
+ * of a recorded value is below 1/TEST_HIST_SUB_BUCKETS. Recording is a
+ * count-leading-zeros and an increment, and histograms of the same layout
+ * can be merged by adding the counts, which lets each thread keep its own.
+ */
+#define TEST_HIST_SUB_BUCKET_BITS 4
+#define TEST_HIST_SUB_BUCKETS (1 << TEST_HIST_SUB_BUCKET_BITS)
+#define TEST_HIST_BUCKETS ((64 - TEST_HIST_SUB_BUCKET_BITS + 1) * TEST_HIST_SUB_BUCKETS)
+
+typedef struct {
+	const char *name;
+	uint64_t counts[TEST_HIST_BUCKETS];
+	uint64_t total;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+} test_histogram;
+
+void test_histogram_init(test_histogram *hist, const char *name);
+void test_histogram_record(test_histogram *hist, uint64_t value);
+void test_histogram_merge(test_histogram *dst, const test_histogram *src);
+
+/* upper bound of the bucket holding the given percentile (0 to 100). */
+uint64_t test_histogram_percentile(const test_histogram *hist, double percentile);
+
+/* one line with count, mean and percentiles, values are printed in us. */
+void test_histogram_print(const test_histogram *hist);
+
+/* every non-empty bucket as "low high count", values in ns. */
+void test_histogram_dump(const test_histogram *hist);
+
+#endif /* __TEST_HISTOGRAM_H__ */